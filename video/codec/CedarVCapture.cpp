@@ -0,0 +1,344 @@
+/*
+ * Copyright (c) 2018-2020 WangBin <wbsecg1 at gmail.com>
+ */
+#include "CedarVCapture.h"
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <thread>
+extern "C" {
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+}
+
+using namespace std;
+
+static const char kMagic[8] = {'C', 'D', 'V', 'C', 'A', 'P', '0', '1'};
+
+static uint64_t align64(uint64_t v)
+{
+    return (v + 63) & ~uint64_t(63);
+}
+
+// tiled planes of the size used by host maps if not reported by libcedarv
+static void tiled_plane_sizes(const cedarv_picture_t& pic, uint32_t* size_y, uint32_t* size_u)
+{
+    const uint32_t w = (max(pic.width, pic.display_width) + 31) & ~31u;
+    const uint32_t h = max(pic.height, pic.display_height);
+    *size_y = pic.size_y ? pic.size_y : w*((h + 31) & ~31u);
+    *size_u = pic.size_u ? pic.size_u : w*((h/2 + 31) & ~31u);
+}
+
+bool CedarVCaptureWriter::open(const string& path, const char* codec, int width, int height, const void* extra, size_t extra_size)
+{
+    lock_guard<mutex> lock(mutex_);
+    if (fp_)
+        fclose(fp_);
+    fp_ = fopen(path.data(), "wb");
+    if (!fp_) {
+        std::clog << "CedarV capture: failed to open " << path << std::endl;
+        return false;
+    }
+    CedarVCaptureHeader h{};
+    memcpy(h.magic, kMagic, sizeof(kMagic));
+    h.extra_size = uint32_t(extra_size);
+    h.header_size = uint32_t(align64(sizeof(h) + extra_size));
+    strncpy(h.codec, codec, sizeof(h.codec) - 1);
+    h.width = width;
+    h.height = height;
+    fwrite(&h, sizeof(h), 1, fp_);
+    if (extra_size)
+        fwrite(extra, extra_size, 1, fp_);
+    static const uint8_t zeros[64]{};
+    fwrite(zeros, h.header_size - sizeof(h) - extra_size, 1, fp_);
+    offset_ = h.header_size;
+    packets_ = 0;
+    std::clog << "CedarV capture: " << path << std::endl;
+    return true;
+}
+
+void CedarVCaptureWriter::close()
+{
+    lock_guard<mutex> lock(mutex_);
+    if (!fp_)
+        return;
+    fclose(fp_);
+    fp_ = nullptr;
+}
+
+void CedarVCaptureWriter::write(const CedarVCaptureRecord& r, const void* const* data, const size_t* sizes, int count)
+{
+    static const uint8_t zeros[64]{};
+    fwrite(&r, sizeof(r), 1, fp_);
+    for (int i = 0; i < count; ++i) {
+        if (sizes[i])
+            fwrite(data[i], sizes[i], 1, fp_);
+        const size_t pad = align64(sizes[i]) - sizes[i];
+        if (pad)
+            fwrite(zeros, pad, 1, fp_);
+    }
+    offset_ += sizeof(r) + r.size;
+}
+
+void CedarVCaptureWriter::writePacket(const void* data, size_t size, int64_t pts, bool key, uint64_t decode_ns)
+{
+    lock_guard<mutex> lock(mutex_);
+    if (!fp_)
+        return;
+    CedarVCaptureRecord r{};
+    r.type = CedarVCaptureRecord::Packet;
+    r.flags = key ? 1 : 0;
+    r.size = align64(size);
+    r.data_size = size;
+    r.pts = pts;
+    r.duration_ns = decode_ns;
+    r.packet = packets_++;
+    write(r, &data, &size, 1);
+}
+
+uint64_t CedarVCaptureWriter::nextPacket()
+{
+    lock_guard<mutex> lock(mutex_);
+    return packets_;
+}
+
+void CedarVCaptureWriter::writePicture(const cedarv_picture_t& pic, uint64_t packet)
+{
+    lock_guard<mutex> lock(mutex_);
+    if (!fp_)
+        return;
+    CedarVCapturePicture info{};
+    info.width = pic.width;
+    info.height = pic.height;
+    info.display_width = pic.display_width;
+    info.display_height = pic.display_height;
+    info.top_offset = pic.top_offset;
+    info.left_offset = pic.left_offset;
+    info.store_width = pic.store_width;
+    info.store_height = pic.store_height;
+    info.pixel_format = pic.pixel_format;
+    tiled_plane_sizes(pic, &info.size_y, &info.size_u);
+    CedarVCaptureRecord r{};
+    r.type = CedarVCaptureRecord::Picture;
+    r.pts = pic.pts;
+    r.packet = packet;
+    r.size = sizeof(info) + align64(info.size_y) + align64(info.size_u);
+    const void* data[] = {&info, pic.y, pic.u};
+    const size_t sizes[] = {sizeof(info), info.size_y, info.size_u};
+    write(r, data, sizes, 3);
+}
+
+CedarVCaptureFile::~CedarVCaptureFile()
+{
+    if (map_)
+        munmap(map_, size_);
+}
+
+bool CedarVCaptureFile::open(const string& path)
+{
+    const int fd = ::open(path.data(), O_RDONLY);
+    if (fd < 0) {
+        std::clog << "CedarV capture: failed to open " << path << std::endl;
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == 0 && size_t(st.st_size) >= sizeof(CedarVCaptureHeader)) {
+        size_ = st.st_size;
+        void* p = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+        map_ = p == MAP_FAILED ? nullptr : (uint8_t*)p;
+    }
+    ::close(fd);
+    if (!map_ || memcmp(header().magic, kMagic, sizeof(kMagic)) || header().header_size > size_) {
+        std::clog << "CedarV capture: invalid file " << path << std::endl;
+        return false;
+    }
+    madvise(map_, size_, MADV_WILLNEED);
+    for (size_t offset = header().header_size; offset + sizeof(CedarVCaptureRecord) <= size_;) {
+        const auto r = (const CedarVCaptureRecord*)(map_ + offset);
+        if (r->size > size_ - offset - sizeof(*r)) // truncated
+            break;
+        if (r->type == CedarVCaptureRecord::Packet)
+            packets_.push_back(r);
+        else if (r->type == CedarVCaptureRecord::Picture && r->size >= sizeof(CedarVCapturePicture))
+            pictures_.push_back(r);
+        offset += sizeof(*r) + r->size;
+    }
+    // pictures are in output order, i.e. packet indices are not decreasing
+    first_picture_.resize(packets_.size() + 1);
+    size_t i = 0;
+    for (size_t j = 0; j < packets_.size(); ++j) {
+        while (i < pictures_.size() && pictures_[i]->packet < j)
+            ++i;
+        first_picture_[j] = i;
+    }
+    first_picture_.back() = pictures_.size();
+    std::clog << "CedarV capture " << path << ": " << header().codec << " " << header().width << "x" << header().height
+              << ", packets: " << packets_.size() << ", pictures: " << pictures_.size() << std::endl;
+    return true;
+}
+
+size_t CedarVCaptureFile::picturesOf(size_t packet, size_t* first) const
+{
+    if (packet >= packets_.size()) {
+        *first = pictures_.size();
+        return 0;
+    }
+    *first = first_picture_[packet];
+    return first_picture_[packet + 1] - first_picture_[packet];
+}
+
+namespace {
+struct replay_decoder {
+    CEDARV_DECODER api; // the 1st member
+    shared_ptr<CedarVCaptureFile> file;
+    double speed;
+    mutex mtx;
+    vector<uint8_t> ring;
+    size_t write_pos = 0;
+    size_t used = 0; // written and not decoded
+    size_t partial = 0; // bytes of a packet without the last part
+    deque<size_t> packets; // complete packet bytes
+    uint64_t decoded = 0;
+    deque<size_t> ready; // picture indices
+    int outstanding = 0; // requested and not released
+
+    static replay_decoder* from(CEDARV_DECODER* p) { return (replay_decoder*)p; }
+
+    void reset() {
+        write_pos = used = partial = 0;
+        packets.clear();
+        ready.clear();
+    }
+};
+
+s32 replay_request_write(CEDARV_DECODER* p, u32 size, u8** buf0, u32* size0, u8** buf1, u32* size1)
+{
+    auto d = replay_decoder::from(p);
+    lock_guard<mutex> lock(d->mtx);
+    if (size > d->ring.size() - d->used)
+        return -1;
+    *buf0 = d->ring.data() + d->write_pos;
+    *size0 = u32(std::min<size_t>(size, d->ring.size() - d->write_pos));
+    *buf1 = size > *size0 ? d->ring.data() : nullptr;
+    *size1 = size - *size0;
+    return 0;
+}
+
+s32 replay_update_data(CEDARV_DECODER* p, cedarv_stream_data_info_t* info)
+{
+    auto d = replay_decoder::from(p);
+    lock_guard<mutex> lock(d->mtx);
+    if (info->lengh > d->ring.size() - d->used)
+        return -1;
+    d->write_pos = (d->write_pos + info->lengh) % d->ring.size();
+    d->used += info->lengh;
+    d->partial += info->lengh;
+    if (info->flags & CEDARV_FLAG_LAST_PART) {
+        d->packets.push_back(d->partial);
+        d->partial = 0;
+    }
+    return 0;
+}
+
+s32 replay_decode(CEDARV_DECODER* p)
+{
+    auto d = replay_decoder::from(p);
+    unique_lock<mutex> lock(d->mtx);
+    if (d->packets.empty() || !d->file->packets())
+        return 1; // no bitstream
+    d->used -= d->packets.front();
+    d->packets.pop_front();
+    const size_t index = d->decoded++ % d->file->packets();
+    lock.unlock();
+    const double ns = double(d->file->packet(index).duration_ns)*d->speed;
+    if (ns > 0)
+        this_thread::sleep_for(chrono::nanoseconds(uint64_t(ns)));
+    size_t first = 0;
+    const size_t n = d->file->picturesOf(index, &first);
+    lock.lock();
+    for (size_t i = 0; i < n; ++i)
+        d->ready.push_back(first + i);
+    return 0;
+}
+
+s32 replay_display_request(CEDARV_DECODER* p, cedarv_picture_t* pic)
+{
+    auto d = replay_decoder::from(p);
+    lock_guard<mutex> lock(d->mtx);
+    if (d->ready.empty())
+        return -1;
+    const size_t index = d->ready.front();
+    d->ready.pop_front();
+    const auto& r = d->file->picture(index);
+    const auto& info = CedarVCaptureFile::pictureInfo(r);
+    pic->id = u32(index);
+    pic->width = info.width;
+    pic->height = info.height;
+    pic->display_width = info.display_width;
+    pic->display_height = info.display_height;
+    pic->top_offset = info.top_offset;
+    pic->left_offset = info.left_offset;
+    pic->store_width = info.store_width;
+    pic->store_height = info.store_height;
+    pic->pixel_format = info.pixel_format;
+    pic->pts = r.pts;
+    pic->y = (u8*)CedarVCaptureFile::luma(r);
+    pic->u = (u8*)CedarVCaptureFile::chroma(r);
+    pic->size_y = info.size_y;
+    pic->size_u = info.size_u;
+    d->outstanding++;
+    return 0;
+}
+
+s32 replay_display_release(CEDARV_DECODER* p, u32)
+{
+    auto d = replay_decoder::from(p);
+    lock_guard<mutex> lock(d->mtx);
+    d->outstanding--;
+    return 0;
+}
+
+s32 replay_ioctrl(CEDARV_DECODER* p, u32 cmd, u32)
+{
+    auto d = replay_decoder::from(p);
+    lock_guard<mutex> lock(d->mtx);
+    if (cmd == CEDARV_COMMAND_JUMP || cmd == CEDARV_COMMAND_RESET || cmd == CEDARV_COMMAND_FLUSH)
+        d->reset();
+    return 0;
+}
+
+s32 replay_nop(CEDARV_DECODER*) { return 0; }
+s32 replay_set_vstream_info(CEDARV_DECODER*, cedarv_stream_info_t*) { return 0; }
+} // namespace
+
+CEDARV_DECODER* cedarv_replay_create(shared_ptr<CedarVCaptureFile> file, double speed, size_t ring_size)
+{
+    if (!file)
+        return nullptr;
+    auto d = new replay_decoder();
+    d->file = file;
+    d->speed = std::max(speed, 0.0);
+    d->ring.resize(ring_size);
+    d->api.open = replay_nop;
+    d->api.close = replay_nop;
+    d->api.decode = replay_decode;
+    d->api.ioctrl = replay_ioctrl;
+    d->api.request_write = replay_request_write;
+    d->api.update_data = replay_update_data;
+    d->api.display_request = replay_display_request;
+    d->api.display_release = replay_display_release;
+    d->api.set_vstream_info = replay_set_vstream_info;
+    return &d->api;
+}
+
+void cedarv_replay_destroy(CEDARV_DECODER* p)
+{
+    auto d = replay_decoder::from(p);
+    if (d && d->outstanding > 0)
+        std::clog << "CedarV replay: " << d->outstanding << " pictures are not released" << std::endl;
+    delete d;
+}
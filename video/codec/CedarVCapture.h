@@ -0,0 +1,107 @@
+/*
+ * Copyright (c) 2018-2020 WangBin <wbsecg1 at gmail.com>
+ */
+// CedarV packet and picture capture in a memory mappable file, and a CEDARV_DECODER replaying it. no mdk dependency
+// file: CedarVCaptureHeader, codec extra data, then records. every record starts at a multiple of 64 bytes with a CedarVCaptureRecord.
+//   packet record: compressed data fed to the decoder, duration_ns is the time of decode()
+//   picture record: CedarVCapturePicture, tiled luma at +sizeof(CedarVCapturePicture), tiled interleaved chroma after luma aligned to 64.
+//   packet is the index of the packet whose write(decoding to free ring space) or decode() outputs the picture
+#pragma once
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+extern "C" {
+#include <libcedarv/libcedarv.h>
+}
+
+struct CedarVCaptureHeader {
+    char magic[8]; // "CDVCAP01"
+    uint32_t header_size; // including extra data, aligned to 64
+    uint32_t extra_size;
+    char codec[32];
+    uint32_t width;
+    uint32_t height;
+    uint32_t reserved[6];
+};
+
+struct CedarVCaptureRecord {
+    enum Type : uint32_t {
+        Packet = 1,
+        Picture = 2,
+    };
+    uint32_t type;
+    uint32_t flags; // packet: 1 if key frame
+    uint64_t size; // payload bytes, a multiple of 64
+    int64_t pts; // CedarV time scale
+    uint64_t duration_ns; // packet: decode() time
+    uint64_t packet; // picture: output by packet index
+    uint64_t data_size; // packet: compressed bytes
+    uint64_t reserved[2];
+};
+
+struct CedarVCapturePicture {
+    uint32_t width;
+    uint32_t height;
+    uint32_t display_width;
+    uint32_t display_height;
+    uint32_t top_offset;
+    uint32_t left_offset;
+    uint32_t store_width;
+    uint32_t store_height;
+    uint32_t pixel_format;
+    uint32_t size_y;
+    uint32_t size_u; // interleaved uv
+    uint32_t reserved[5];
+};
+
+// thread safe
+class CedarVCaptureWriter {
+public:
+    ~CedarVCaptureWriter() { close(); }
+    bool open(const std::string& path, const char* codec, int width, int height, const void* extra, size_t extra_size);
+    void close();
+    void writePacket(const void* data, size_t size, int64_t pts, bool key, uint64_t decode_ns);
+    uint64_t nextPacket(); // index of the next written packet
+    void writePicture(const cedarv_picture_t& pic, uint64_t packet); // output by the packet of index
+private:
+    void write(const CedarVCaptureRecord& r, const void* const* data, const size_t* sizes, int count);
+
+    std::mutex mutex_;
+    FILE* fp_ = nullptr;
+    uint64_t offset_ = 0;
+    uint64_t packets_ = 0;
+};
+
+class CedarVCaptureFile {
+public:
+    ~CedarVCaptureFile();
+    bool open(const std::string& path);
+    const CedarVCaptureHeader& header() const { return *(const CedarVCaptureHeader*)map_; }
+    const uint8_t* extra() const { return map_ + sizeof(CedarVCaptureHeader); }
+    size_t packets() const { return packets_.size(); }
+    const CedarVCaptureRecord& packet(size_t i) const { return *packets_[i]; }
+    size_t pictures() const { return pictures_.size(); }
+    const CedarVCaptureRecord& picture(size_t i) const { return *pictures_[i]; }
+    // pictures [*first, *first + count) are output by the packet
+    size_t picturesOf(size_t packet, size_t* first) const;
+
+    static const uint8_t* data(const CedarVCaptureRecord& r) { return (const uint8_t*)(&r + 1); }
+    static const CedarVCapturePicture& pictureInfo(const CedarVCaptureRecord& r) { return *(const CedarVCapturePicture*)data(r); }
+    static const uint8_t* luma(const CedarVCaptureRecord& r) { return data(r) + sizeof(CedarVCapturePicture); }
+    static const uint8_t* chroma(const CedarVCaptureRecord& r) { return luma(r) + ((pictureInfo(r).size_y + 63) & ~63u); }
+private:
+    uint8_t* map_ = nullptr;
+    size_t size_ = 0;
+    std::vector<const CedarVCaptureRecord*> packets_;
+    std::vector<const CedarVCaptureRecord*> pictures_;
+    std::vector<size_t> first_picture_; // packets() + 1 entries
+};
+
+// a decoder replaying pictures of a capture. compressed data is not parsed, request_write() and update_data() emulate a ring of ring_size bytes.
+// decode() consumes a complete packet, takes the recorded time x speed(0: no wait), then pictures recorded for the packet are ready for display_request().
+// packets more than recorded replay the capture again. picture data are in the read only file map
+CEDARV_DECODER* cedarv_replay_create(std::shared_ptr<CedarVCaptureFile> file, double speed = 1.0, size_t ring_size = 4 << 20);
+void cedarv_replay_destroy(CEDARV_DECODER* p);
@@ -0,0 +1,168 @@
+/*
+ * Copyright (c) 2018-2020 WangBin <wbsecg1 at gmail.com>
+ */
+#include "CedarVScheduler.h"
+#include <algorithm>
+#include <iostream>
+
+MDK_NS_BEGIN
+using namespace std;
+// a session acquiring again within it after release is busy, e.g. decoding packets back to back, and keeps its credit
+static const auto kIdleGap = chrono::milliseconds(5);
+
+CedarVScheduler& CedarVScheduler::instance()
+{
+    static CedarVScheduler sched;
+    return sched;
+}
+
+CedarVScheduler::SessionRef CedarVScheduler::open(const string& name, const Config& config)
+{
+    auto s = make_shared<Session>();
+    s->name_ = name;
+    s->config_ = config;
+    s->config_.weight = std::max(config.weight, 1);
+    s->open_time_ = Session::clock::now();
+    lock_guard<mutex> lock(mutex_);
+    s->vtime_ = minVirtualTime(nullptr);
+    sessions_.push_back(s);
+    return s;
+}
+
+void CedarVScheduler::close(const SessionRef& s)
+{
+    if (!s)
+        return;
+    lock_guard<mutex> lock(mutex_);
+    sessions_.remove(s);
+    cv_.notify_all();
+}
+
+double CedarVScheduler::minVirtualTime(const Session* except) const
+{
+    double t = -1;
+    for (const auto& s : sessions_) {
+        if (s.get() != except && (s->waiting_ || s.get() == running_) && (t < 0 || s->vtime_ < t))
+            t = s->vtime_;
+    }
+    if (t >= 0)
+        return t;
+    for (const auto& s : sessions_) { // all idle
+        if (s.get() != except && s->vtime_ > t)
+            t = s->vtime_;
+    }
+    return std::max(t, 0.0);
+}
+
+CedarVScheduler::Session* CedarVScheduler::next() const
+{
+    Session* n = nullptr;
+    for (const auto& s : sessions_) {
+        if (!s->waiting_)
+            continue;
+        if (!n || s->vtime_ < n->vtime_ || (s->vtime_ == n->vtime_ && s->ticket_ < n->ticket_))
+            n = s.get();
+    }
+    return n;
+}
+
+void CedarVScheduler::acquire(Session* s)
+{
+    const auto t0 = Session::clock::now();
+    unique_lock<mutex> lock(mutex_);
+    // idle sessions do not accumulate credit
+    if (!s->stats_.decodes || t0 - s->released_ > kIdleGap)
+        s->vtime_ = std::max(s->vtime_, minVirtualTime(s));
+    s->waiting_ = true;
+    s->ticket_ = ++ticket_;
+    cv_.wait(lock, [this, s]{ return !running_ && next() == s; });
+    s->waiting_ = false;
+    running_ = s;
+    s->start_ = Session::clock::now();
+    s->stats_.wait_ms += chrono::duration<double, milli>(s->start_ - t0).count();
+}
+
+void CedarVScheduler::release(Session* s, uint64_t bytes)
+{
+    const auto t = Session::clock::now();
+    const double ns = chrono::duration<double, nano>(t - s->start_).count();
+    lock_guard<mutex> lock(mutex_);
+    s->vtime_ += ns/s->config_.weight;
+    s->released_ = t;
+    s->stats_.decodes++;
+    s->stats_.bytes += bytes;
+    s->stats_.busy_ms += ns/1e6;
+    if (running_ == s)
+        running_ = nullptr;
+    cv_.notify_all();
+}
+
+void CedarVScheduler::picturesDecoded(Session* s, int count)
+{
+    lock_guard<mutex> lock(mutex_);
+    s->pictures_ += count;
+    s->stats_.pictures += count;
+}
+
+void CedarVScheduler::pictureReleased(Session* s)
+{
+    lock_guard<mutex> lock(mutex_);
+    s->pictures_--;
+    cv_.notify_all();
+}
+
+bool CedarVScheduler::waitPictures(Session* s)
+{
+    unique_lock<mutex> lock(mutex_);
+    const auto exceeded = [s]{ return s->config_.picture_budget > 0 && s->pictures_ >= s->config_.picture_budget; };
+    if (!exceeded())
+        return true;
+    const auto t0 = Session::clock::now();
+    const bool ok = cv_.wait_for(lock, chrono::milliseconds(s->config_.picture_timeout_ms), [&]{ return !exceeded(); });
+    s->stats_.budget_waits++;
+    s->stats_.budget_wait_ms += chrono::duration<double, milli>(Session::clock::now() - t0).count();
+    if (ok)
+        return true;
+    if (s->stats_.budget_timeouts++ == 0) // once, the following packets may be dropped
+        std::clog << "CedarV session " << s->name_ << ": " << s->pictures_ << " pictures are not released in " << s->config_.picture_timeout_ms << "ms, budget: " << s->config_.picture_budget << std::endl;
+    return !s->config_.drop;
+}
+
+void CedarVScheduler::setConfig(Session* s, const Config& config)
+{
+    lock_guard<mutex> lock(mutex_);
+    s->config_ = config;
+    s->config_.weight = std::max(config.weight, 1);
+    cv_.notify_all();
+}
+
+CedarVScheduler::Config CedarVScheduler::config(const Session* s) const
+{
+    lock_guard<mutex> lock(mutex_);
+    return s->config_;
+}
+
+vector<CedarVScheduler::Stats> CedarVScheduler::stats() const
+{
+    vector<Stats> v;
+    lock_guard<mutex> lock(mutex_);
+    for (const auto& s : sessions_)
+        v.push_back(statsOf(s.get()));
+    return v;
+}
+
+CedarVScheduler::Stats CedarVScheduler::stats(const Session* s) const
+{
+    lock_guard<mutex> lock(mutex_);
+    return statsOf(s);
+}
+
+CedarVScheduler::Stats CedarVScheduler::statsOf(const Session* s) const
+{
+    Stats st = s->stats_;
+    st.name = s->name_;
+    st.config = s->config_;
+    st.seconds = chrono::duration<double>(Session::clock::now() - s->open_time_).count();
+    return st;
+}
+MDK_NS_END
@@ -0,0 +1,101 @@
+/*
+ * Copyright (c) 2018-2020 WangBin <wbsecg1 at gmail.com>
+ */
+// orders decode() calls of decoder sessions on the single video engine. every decoder keeps its own libcedarv instance and state,
+// sessions are not multiplexed into one instance. no libcedarv dependency, so the scheduling can be tested with any decode function.
+// weighted fair queuing: the waiting session with the least engine time/weight runs next. a session joining or idle for a while starts from
+// the least virtual time of the others, so it can not take the engine for a long time to catch up.
+#pragma once
+#include "mdk/global.h"
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+MDK_NS_BEGIN
+class CedarVScheduler {
+public:
+    struct Config {
+        int weight = 1; // share of engine time
+        int picture_budget = 0; // max decoded pictures not released before the next decode. 0: no limit
+        int picture_timeout_ms = 100; // max wait for the picture budget
+        bool drop = false; // if the budget is still exceeded after timeout, the decoder drops the packet. otherwise decode anyway
+        size_t bitstream_budget = 0; // max queued compressed bytes. 0: no limit, used by the decoder
+    };
+    struct Stats {
+        std::string name;
+        Config config;
+        uint64_t decodes = 0;
+        uint64_t bytes = 0;
+        uint64_t pictures = 0;
+        double busy_ms = 0; // engine time
+        double wait_ms = 0; // waiting for engine
+        uint64_t budget_waits = 0; // waited for released pictures
+        double budget_wait_ms = 0;
+        uint64_t budget_timeouts = 0;
+        double seconds = 0; // since open
+        double fps() const { return seconds > 0 ? pictures/seconds : 0; }
+        double kbps() const { return seconds > 0 ? bytes*8/1000.0/seconds : 0; }
+    };
+    class Session;
+    using SessionRef = std::shared_ptr<Session>;
+
+    static CedarVScheduler& instance();
+
+    SessionRef open(const std::string& name, const Config& config);
+    void close(const SessionRef& s);
+    // blocks until the engine is free and it's the session's turn
+    void acquire(Session* s);
+    void release(Session* s, uint64_t bytes);
+    // decoded pictures count in picture budget until released
+    void picturesDecoded(Session* s, int count);
+    void pictureReleased(Session* s);
+    // waits at most picture_timeout_ms if picture budget is exceeded. false if still exceeded and drop is set
+    bool waitPictures(Session* s);
+    void setConfig(Session* s, const Config& config);
+    Config config(const Session* s) const;
+    std::vector<Stats> stats() const; // all open sessions
+    Stats stats(const Session* s) const;
+
+    // engine is held in scope
+    class Slot {
+    public:
+        Slot(CedarVScheduler& sched, Session* s, uint64_t bytes = 0) : sched_(sched), s_(s), bytes_(bytes) { if (s_) sched_.acquire(s_); }
+        ~Slot() { if (s_) sched_.release(s_, bytes_); }
+    private:
+        CedarVScheduler& sched_;
+        Session* s_;
+        uint64_t bytes_;
+    };
+private:
+    Session* next() const; // waiting session to run
+    double minVirtualTime(const Session* except) const;
+    Stats statsOf(const Session* s) const;
+
+    mutable std::mutex mutex_;
+    std::condition_variable cv_;
+    std::list<SessionRef> sessions_;
+    Session* running_ = nullptr;
+    uint64_t ticket_ = 0;
+};
+
+class CedarVScheduler::Session {
+    friend class CedarVScheduler;
+    using clock = std::chrono::steady_clock;
+
+    std::string name_;
+    Config config_;
+    double vtime_ = 0; // engine ns/weight
+    bool waiting_ = false;
+    uint64_t ticket_ = 0; // arrival order of waiting sessions, breaks ties
+    int pictures_ = 0; // not released
+    clock::time_point open_time_;
+    clock::time_point start_; // engine acquired
+    clock::time_point released_;
+    Stats stats_;
+};
+MDK_NS_END
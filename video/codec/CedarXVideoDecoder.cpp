@@ -3,31 +3,262 @@
  * Copyright (c) 2018-2020 WangBin <wbsecg1 at gmail.com>
  * Original code is from QtAV project
  */
+// env: CEDARX_ASYNC=0/1: decode in a dedicated thread, frames are delivered in decode() of the caller thread. CEDARX_PACKET_QUEUE=n: max queued packets in async mode, default is 8
+// CEDARX_STATS=seconds: dump stage statistics of decoder and pool periodically
+// CEDARX_SCHED=0/1: share the video engine between decoders by weighted fair queuing, default is 1. CEDARX_WEIGHT=n: engine time share, default is 1
+// CEDARX_PICTURE_BUDGET=n: pictures not released by consumers to wait in decode() before decoding more, 0(default): no limit. CEDARX_PICTURE_TIMEOUT=ms: max wait, default is 100
+//   CEDARX_BUDGET_DROP=1: drop the packet if pictures are still not released after timeout, decoding resumes from the next key frame
+// CEDARX_BITSTREAM_BUDGET=KB: max queued compressed data in async mode
+// CEDARX_SKIP=0/1: skip non-reference frames, then non-key frames if consumer falls behind, default is 1. CEDARX_SKIP_DEPTH=n: pictures in flight to skip more, default is 5
+// CEDARX_SKIP_LATE=ms: frame lateness to skip more, 0 to disable, default is 100
+// CEDARX_KEY_WAIT=n: max non-key packets skipped after seeking, default is 300. no packet is skipped if the stream has no key frame flag
+// CEDARX_RECORD=file: capture packets and decoded tiled pictures. CEDARX_REPLAY=file: replay pictures of a capture instead of hardware decoding, no cedar device is required.
+//   CEDARX_REPLAY_SPEED=x: recorded decode time x, 0 is no wait, default is 1
+// CEDARX_WARM_POOL=n: max closed decoders kept initialized in process and reused by open(), default is 1. 0: release hardware in close()
+// length prefixed h264(avcC) is converted to annex-b while copying into the ring, sps and pps of extra data are inserted before key frames
+#include "CedarXVideoDecoder.h"
+#include "CedarVCapture.h"
+#include "CedarVScheduler.h"
+#include "video/hwa/CedarVBuffer.h"
 #include "mdk/VideoDecoder.h"
 #include "mdk/MediaInfo.h"
 #include "mdk/Packet.h"
 #include "mdk/VideoFrame.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <deque>
 #include <iostream>
+#include <list>
+#include <mutex>
+#include <thread>
 extern "C" {
+#include <pthread.h>
 #include <libcedarv/libcedarv.h>
 }
 // TODO: libcedarv allocate memory by ump, and add picture ump flag
 MDK_NS_BEGIN
 using namespace std;
-class CedarXVideoDecoder final : public VideoDecoder
+// request_write() returns the same space until update_data(), so only the last allocated packet is in ring
+struct CedarVStreamRing {
+    std::mutex mutex;
+    CedarVPacketBuffer* pending = nullptr;
+};
+
+// an initialized libcedarv or replay decoder, shared by CedarXVideoDecoder, its pictures in flight and the warm pool
+struct CedarVInstance {
+    CEDARV_DECODER* dec = nullptr;
+    bool replay = false;
+    bool opened = false; // dec->open() succeeded and dec->close() is not called yet
+    cedarv_stream_info_t info{}; // init_data is not used
+    vector<uint8_t> extra; // init_data
+    std::mutex mutex; // serializes libcedarv calls, e.g. decode() in decoding thread and display_release() by consumers. guards pictures and closed
+    int pictures = 0; // requested by display_request() and not released
+    bool closed = false; // by CedarXVideoDecoder. pooled when the last picture is released
+
+    ~CedarVInstance() {
+        if (!dec)
+            return;
+        if (opened)
+            dec->close(dec); // does not affect picture release?
+        if (replay)
+            cedarv_replay_destroy(dec);
+        else
+            libcedarv_exit(dec);
+    }
+    bool same(const cedarv_stream_info_t& i, const vector<uint8_t>& e) const {
+        return info.format == i.format && info.sub_format == i.sub_format && info.video_width == i.video_width && info.video_height == i.video_height && extra == e;
+    }
+};
+using CedarVInstanceRef = shared_ptr<CedarVInstance>;
+
+// initialized decoders closed by CedarXVideoDecoder. reconfiguring an open decoder is much faster than libcedarv_init() and buffer allocation
+class CedarVDecoderPool {
+public:
+    static CedarVDecoderPool& instance() {
+        static CedarVDecoderPool pool;
+        return pool;
+    }
+    int maxIdle() const { return max_idle_; }
+    // prefers a decoder of the same config
+    CedarVInstanceRef take(const cedarv_stream_info_t& info, const vector<uint8_t>& extra, bool replay) {
+        lock_guard<mutex> lock(mutex_);
+        auto it = find_if(idle_.begin(), idle_.end(), [&](const CedarVInstanceRef& i){ return i->replay == replay && i->same(info, extra); });
+        if (it == idle_.end())
+            it = find_if(idle_.begin(), idle_.end(), [&](const CedarVInstanceRef& i){ return i->replay == replay; });
+        if (it == idle_.end())
+            return nullptr;
+        auto dec = std::move(*it);
+        idle_.erase(it);
+        dec->closed = false;
+        return dec;
+    }
+    // no picture is in flight
+    void put(CedarVInstanceRef dec) {
+        CedarVInstanceRef evicted;
+        {
+            lock_guard<mutex> lock(mutex_);
+            idle_.push_back(std::move(dec));
+            if (int(idle_.size()) <= max_idle_)
+                return;
+            evicted = std::move(idle_.front());
+            idle_.pop_front();
+        }
+        // libcedarv_exit() out of lock
+    }
+private:
+    CedarVDecoderPool() {
+        const char* env = getenv("CEDARX_WARM_POOL");
+        if (env)
+            max_idle_ = std::max(atoi(env), 0);
+    }
+
+    int max_idle_ = 1;
+    mutex mutex_;
+    list<CedarVInstanceRef> idle_;
+};
+
+// decoded picture records and the release side of decoding. shared by CedarXVideoDecoder and its pictures in flight,
+// which may be released after the decoder is closed or destroyed. records are recycled, so no allocation after warm up
+struct CedarXPictures {
+    struct picture_t {
+        cedarv_picture_t pic; // the 1st member
+        chrono::steady_clock::time_point decoded;
+        CedarVInstanceRef dec; // released to
+        shared_ptr<CedarXPictures> owner; // in flight only, no reference cycle in free list
+    };
+    enum { MaxConsumers = 8 }; // the last is shared by more consumers
+
+    ~CedarXPictures() {
+        for (auto p : free)
+            delete p;
+    }
+    picture_t* get();
+    void put(picture_t* p);
+    static void release(cedarv_picture_t* pic); // called by the last consumer
+    int holder(); // index of current thread in hold stats
+
+    mutable std::mutex mutex;
+    condition_variable released; // a picture is released
+    vector<picture_t*> free;
+    atomic<uint64_t> allocations{0};
+    atomic<int> in_flight{0};
+    CedarXPictureStats stats; // guarded by mutex
+    CedarVScheduler::SessionRef session; // released pictures are counted
+    mutable std::mutex hold_mutex;
+    thread::id holders[MaxConsumers];
+    char holder_names[MaxConsumers][16]{};
+    int nb_holders = 0;
+    CedarVStageCounter hold[MaxConsumers];
+};
+
+class CedarXVideoDecoder final : public VideoDecoder, public CedarXDecoderControl, public CedarXReplayControl
 {
 public:
+    ~CedarXVideoDecoder() override;
     const char* name() const override {return "CedarX";}
     bool open() override;
     bool close() override;
-    bool flush() override {
-        onFlush();
-        return true;
-    }
+    bool flush() override;
     bool decode(const Packet& pkt) override;
+    BufferRef allocatePacket(size_t size) override;
+    CedarXQueueStats queueStats() const override;
+    CedarXSeekStats seekStats() const override;
+    uint64_t frameAllocations() const override;
+    void stageStats(CedarVStageStats* stats) const override;
+    int picturesInFlight() const override { return pics_->in_flight; }
+    void setScheduling(const CedarVScheduler::Config& config) override;
+    CedarVScheduler::Stats schedulingStats() const override;
+    void setSkipPolicy(const CedarXSkipPolicy& policy) override;
+    CedarXSkipStats skipStats() const override;
+    CedarXPictureStats pictureStats() const override;
+    int holdStats(CedarXHoldStats* stats, int count) const override;
+    CedarXDecodeStatus lastDecodeStatus() const override { return status_; }
+    CedarXOpenStats openStats() const override;
+    void setFrameCallback(function<void(const VideoFrame&)> cb) override { frame_cb_ = dec_ && !dec_->replay ? nullptr : cb; } // CedarXReplayControl
 private:
-    shared_ptr<CEDARV_DECODER> dec_;
+    void dumpStats();
+    // frames: pictures decoded to free ring space
+    bool writeStream(const Packet& pkt, vector<VideoFrame>* frames);
+    bool writeChunks(const Packet& pkt, const uint8_t* data, size_t size, unique_lock<mutex>& ring_lock, vector<VideoFrame>* frames); // ring is locked
+    bool decodePacket(const Packet& pkt, vector<VideoFrame>* frames);
+    void invalidNalLengths(const Packet& pkt); // avcC packet is submitted without conversion
+    void recordStream(const uint8_t* part0, size_t size0, const uint8_t* part1, size_t size);
+    int receivePictures(vector<VideoFrame>* frames); // all ready pictures
+    bool decodeAsync(const Packet& pkt);
+    void deliverFrames(unique_lock<mutex>& lock);
+    void run();
+    void stopThread();
+    void frameDelivered(const vector<VideoFrame>& frames); // called by the caller thread before delivering frames
+    bool waitPictures(); // false if the packet is dropped
+    bool skipPacket(const Packet& pkt); // caller thread
+
+    CedarVInstanceRef dec_;
+    shared_ptr<CedarVStreamRing> ring_ = make_shared<CedarVStreamRing>();
+    // async mode
+    bool async_ = false;
+    size_t max_packets_ = 8;
+    thread thread_;
+    mutable mutex mutex_;
+    condition_variable cv_; // packet queued or stop
+    condition_variable space_cv_; // packet dequeued
+    condition_variable idle_cv_; // no packet and not decoding
+    deque<Packet> packets_;
+    vector<VideoFrame> frames_;
+    vector<VideoFrame> decoded_; // used by decoding thread
+    vector<VideoFrame> ready_; // used by caller thread
+    bool stop_ = false;
+    bool busy_ = false;
+    bool error_ = false;
+    CedarXQueueStats stats_;
+    // seek
+    atomic<bool> wait_key_{false}; // also set by decoding thread if a packet is partially submitted
+    bool has_key_flags_ = false; // a packet has key frame flag since open
+    int max_key_wait_ = 300; // max skipped packets waiting for a key frame
+    int key_wait_packets_ = 0;
+    bool seeking_ = false;
+    chrono::steady_clock::time_point seek_time_;
+    CedarXSeekStats seek_stats_;
+    // open
+    bool opening_ = false; // no frame since open
+    chrono::steady_clock::time_point open_time_;
+    CedarXOpenStats open_stats_;
+    vector<uint8_t> extra_; // init_data. annex-b parameter sets if nal_length_size_ > 0
+    int nal_length_size_ = 0; // > 0: avcC, length prefixed nal units are converted to annex-b while writing the ring
+    vector<uint8_t> annexb_; // converted packet submitted in chunks
+    atomic<uint64_t> invalid_nal_packets_{0}; // invalid nal lengths, submitted without conversion
     NativeVideoBufferPoolRef pool_ = NativeVideoBufferPool::create("CedarV"); // GLVA.CedarV
+    // vectors above keep capacity, so no allocation after warm up
+    shared_ptr<CedarXPictures> pics_ = make_shared<CedarXPictures>();
+    // stats
+    CedarVStageCounter stages_[CedarVStageCount]; // decoder stages only
+    CedarXDecodeStatus status_ = CedarXDecodeOk;
+    // engine sharing and picture budget. pics_ keeps the session until the last picture is released
+    CedarVScheduler::SessionRef session_;
+    bool arbitrate_ = true; // wait for engine
+    CedarVScheduler::Config sched_config_;
+    size_t queued_bytes_ = 0; // async mode
+    // load adaptive skipping. states are updated in caller thread. dumpStats() may be called with mutex_ locked
+    mutable mutex skip_mutex_;
+    CedarXSkipPolicy skip_policy_;
+    CedarXSkipStats skip_stats_;
+    int skip_level_ = CedarXSkipNone;
+    int level_packets_ = 0; // since last level change
+    int calm_packets_ = 0; // consecutive packets without load
+    double lateness_ms_ = 0;
+    double pts_base_ms_ = 0; // min(wall clock - pts)
+    bool has_pts_base_ = false;
+    chrono::steady_clock::time_point last_delivery_;
+    atomic<bool> drop_nonref_{false};
+    bool drop_nonref_applied_ = false; // decoding thread
+    unique_ptr<CedarVCaptureWriter> recorder_;
+    vector<uint8_t> record_; // bytes submitted to the ring for the packet being decoded
+    atomic<uint64_t> record_packet_{0}; // capture index of the packet being written and decoded, pictures received meanwhile are output by it
+    function<void(const VideoFrame&)> frame_cb_; // replay only
+    int stats_interval_ = 0; // seconds
+    chrono::steady_clock::time_point stats_time_;
 };
 
 #define CEDARX_ENSURE(f, ...) CEDARX_CHECK(f, return __VA_ARGS__;)
@@ -68,6 +299,107 @@ static const struct {
     // TODO: h265
 };
 
+// avcC to annex-b sps and pps. returns nal length size, 0 if not avcC
+static int avcc_parameter_sets(const uint8_t* extra, size_t size, vector<uint8_t>* ps)
+{
+    static const uint8_t start_code[] = {0, 0, 0, 1};
+    if (size < 7 || extra[0] != 1)
+        return 0;
+    ps->clear();
+    size_t i = 5;
+    for (int type = 0; type < 2; ++type) { // sps, pps
+        if (i >= size)
+            return 0;
+        int count = type == 0 ? (extra[i] & 0x1f) : extra[i];
+        ++i;
+        while (count-- > 0) {
+            if (i + 2 > size)
+                return 0;
+            const size_t len = (extra[i] << 8) | extra[i + 1];
+            i += 2;
+            if (len > size - i)
+                return 0;
+            ps->insert(ps->end(), start_code, start_code + sizeof(start_code));
+            ps->insert(ps->end(), extra + i, extra + i + len);
+            i += len;
+        }
+    }
+    return (extra[4] & 3) + 1;
+}
+
+// annex-b size of length prefixed nal units, 0 if invalid
+static size_t annexb_size(const uint8_t* data, size_t size, int nal_length_size)
+{
+    size_t out = 0;
+    for (size_t i = 0; i < size;) {
+        if (size - i < size_t(nal_length_size))
+            return 0;
+        size_t len = 0;
+        for (int k = 0; k < nal_length_size; ++k)
+            len = (len << 8) | data[i++];
+        if (len > size - i)
+            return 0;
+        out += 4 + len;
+        i += len;
+    }
+    return out;
+}
+
+// writes 2 ring parts continuously
+struct ring_writer {
+    uint8_t* part[2];
+    size_t size[2];
+    size_t pos;
+
+    void write(const uint8_t* data, size_t n) {
+        if (pos < size[0]) {
+            const size_t k = std::min(n, size[0] - pos);
+            memcpy(part[0] + pos, data, k);
+            pos += k;
+            data += k;
+            n -= k;
+        }
+        if (n) {
+            memcpy(part[1] + pos - size[0], data, n);
+            pos += n;
+        }
+    }
+};
+
+static void write_annexb(ring_writer& w, const uint8_t* data, size_t size, int nal_length_size)
+{
+    static const uint8_t start_code[] = {0, 0, 0, 1};
+    for (size_t i = 0; i < size;) {
+        size_t len = 0;
+        for (int k = 0; k < nal_length_size; ++k)
+            len = (len << 8) | data[i++];
+        w.write(start_code, sizeof(start_code));
+        w.write(data + i, len);
+        i += len;
+    }
+}
+
+// 4 byte lengths to start codes in ring parts
+static bool annexb_in_place(uint8_t* part0, size_t size0, uint8_t* part1, size_t size)
+{
+    auto at = [=](size_t i) -> uint8_t& { return i < size0 ? part0[i] : part1[i - size0]; };
+    for (int pass = 0; pass < 2; ++pass) { // validate, then convert
+        for (size_t i = 0; i < size;) {
+            if (size - i < 4)
+                return false;
+            const size_t len = (size_t(at(i)) << 24) | (at(i + 1) << 16) | (at(i + 2) << 8) | at(i + 3);
+            if (len > size - i - 4)
+                return false;
+            if (pass == 1) {
+                at(i) = at(i + 1) = at(i + 2) = 0;
+                at(i + 3) = 1;
+            }
+            i += 4 + len;
+        }
+    }
+    return true;
+}
+
 bool to_cedarv(const char* name, cedarv_stream_format_e* format, cedarv_sub_format_e *sub_format)
 {
     for (const auto& c : cedarv_codecs) {
@@ -82,6 +414,7 @@ bool to_cedarv(const char* name, cedarv_stream_format_e* format, cedarv_sub_form
 
 bool CedarXVideoDecoder::open()
 {
+    const auto t0 = chrono::steady_clock::now();
     const VideoCodecParameters& par = parameters();
     cedarv_stream_format_e format = CEDARV_STREAM_FORMAT_UNKNOW;
     cedarv_sub_format_e sub_format = CEDARV_SUB_FORMAT_UNKNOW;
@@ -89,79 +422,1009 @@ bool CedarXVideoDecoder::open()
         std::clog << par.codec << " is not supported by CedarV" << std::endl;
         return false;
     }
+    cedarv_stream_info_t info{};
+    info.format = format;
+    info.sub_format = sub_format;
+    info.video_width = par.width; //coded_width?
+    info.video_height = par.height;
+    vector<uint8_t> extra((const uint8_t*)par.extra.data(), (const uint8_t*)par.extra.data() + par.extra.size());
+    nal_length_size_ = 0;
+    if (format == CEDARV_STREAM_FORMAT_H264) {
+        vector<uint8_t> ps;
+        nal_length_size_ = avcc_parameter_sets(extra.data(), extra.size(), &ps);
+        if (nal_length_size_ > 0) {
+            std::clog << "CedarX: avcC with nal length size " << nal_length_size_ << ", converted to annex-b" << std::endl;
+            extra.swap(ps);
+        }
+    }
+    const char* env = getenv("CEDARX_REPLAY");
+    bool warm = false;
+    bool configured = false;
+    if (!dec_ && CedarVDecoderPool::instance().maxIdle() > 0) {
+        if (auto d = CedarVDecoderPool::instance().take(info, extra, !!env)) {
+            configured = d->same(info, extra);
+            if (!configured) { // reopen with new config. a new decoder is created if failed
+                lock_guard<mutex> lock(d->mutex);
+                d->dec->close(d->dec);
+                d->opened = false;
+                d->extra = extra;
+                info.init_data = d->extra.empty() ? nullptr : (u8*)d->extra.data();
+                info.init_data_len = d->extra.size();
+                configured = d->opened = d->dec->set_vstream_info(d->dec, &info) >= 0 && d->dec->open(d->dec) >= 0;
+            }
+            if (configured) {
+                warm = true;
+                dec_ = d;
+            }
+        }
+    }
+    if (!dec_ && env) {
+        auto file = make_shared<CedarVCaptureFile>();
+        if (!file->open(env))
+            return false;
+        const char* speed = getenv("CEDARX_REPLAY_SPEED");
+        dec_ = make_shared<CedarVInstance>();
+        dec_->dec = cedarv_replay_create(file, speed ? atof(speed) : 1.0);
+        dec_->replay = true;
+    }
     if (!dec_) {
         int ret = 0;
         auto dec = libcedarv_init(&ret);
         if (ret < 0 || !dec)
             return false;
-        dec_.reset(dec, [](CEDARV_DECODER* dec){
-            dec->close(dec); // does not affect picture release?
-            libcedarv_exit(dec);
-        });
+        dec_ = make_shared<CedarVInstance>();
+        dec_->dec = dec;
+    }
+    if (!dec_->replay) // CedarXReplayControl
+        frame_cb_ = nullptr;
+    unique_lock<mutex> dec_lock(dec_->mutex);
+    if (!configured) {
+        dec_->extra = extra; // init_data may be used after open()
+        if (!dec_->extra.empty()) {
+            info.init_data = (u8*)dec_->extra.data();
+            info.init_data_len = dec_->extra.size();
+        }
+        CEDARX_ENSURE(dec_->dec->set_vstream_info(dec_->dec, &info), false);
+        CEDARX_ENSURE(dec_->dec->open(dec_->dec), false);
+        dec_->opened = true;
+    }
+    info.init_data = nullptr;
+    info.init_data_len = 0;
+    dec_->info = info;
+    extra_ = std::move(extra);
+    dec_->dec->ioctrl(dec_->dec, CEDARV_COMMAND_RESET, 0);
+    dec_->dec->ioctrl(dec_->dec, CEDARV_COMMAND_PLAY, 0);
+    dec_lock.unlock();
+    drop_nonref_applied_ = false;
+    has_key_flags_ = false;
+    wait_key_ = false;
+    key_wait_packets_ = 0;
+    env = getenv("CEDARX_RECORD");
+    if (env) {
+        record_packet_ = 0;
+        recorder_.reset(new CedarVCaptureWriter());
+        // extra data and packets are recorded as submitted, i.e. annex-b if converted
+        if (!recorder_->open(env, par.codec.data(), par.width, par.height, extra_.data(), extra_.size()))
+            recorder_.reset();
+    }
+    env = getenv("CEDARX_ASYNC");
+    async_ = env && atoi(env) > 0;
+    env = getenv("CEDARX_PACKET_QUEUE");
+    if (env && atoi(env) > 0)
+        max_packets_ = atoi(env);
+    env = getenv("CEDARX_STATS");
+    if (env)
+        stats_interval_ = atoi(env);
+    stats_time_ = chrono::steady_clock::now();
+    env = getenv("CEDARX_SCHED");
+    arbitrate_ = !env || atoi(env) > 0;
+    if (!session_) { // picture budget works without arbitration
+        env = getenv("CEDARX_WEIGHT");
+        if (env)
+            sched_config_.weight = atoi(env);
+        env = getenv("CEDARX_PICTURE_BUDGET");
+        if (env)
+            sched_config_.picture_budget = atoi(env);
+        env = getenv("CEDARX_PICTURE_TIMEOUT");
+        if (env)
+            sched_config_.picture_timeout_ms = atoi(env);
+        env = getenv("CEDARX_BUDGET_DROP");
+        if (env)
+            sched_config_.drop = atoi(env) > 0;
+        env = getenv("CEDARX_BITSTREAM_BUDGET");
+        if (env)
+            sched_config_.bitstream_budget = size_t(atoi(env)) << 10;
+        session_ = CedarVScheduler::instance().open(string("CedarX ") + par.codec.data() + " " + to_string(par.width) + "x" + to_string(par.height), sched_config_);
+        lock_guard<mutex> lock(pics_->mutex);
+        pics_->session = session_;
+    }
+    env = getenv("CEDARX_SKIP");
+    if (env)
+        skip_policy_.enabled = atoi(env) > 0;
+    env = getenv("CEDARX_SKIP_DEPTH");
+    if (env && atoi(env) > 0) {
+        skip_policy_.high_depth = atoi(env);
+        skip_policy_.low_depth = std::min(skip_policy_.low_depth, skip_policy_.high_depth - 1);
+    }
+    env = getenv("CEDARX_SKIP_LATE");
+    if (env)
+        skip_policy_.late_ms = atoi(env);
+    env = getenv("CEDARX_KEY_WAIT");
+    if (env)
+        max_key_wait_ = std::max(atoi(env), 0);
+    if (async_ && !thread_.joinable()) {
+        stats_ = CedarXQueueStats();
+        stop_ = error_ = busy_ = false;
+        thread_ = thread(&CedarXVideoDecoder::run, this);
+    }
+    {
+        lock_guard<mutex> lock(mutex_);
+        opening_ = true;
+        open_time_ = t0;
+        open_stats_.opens++;
+        open_stats_.warm_opens += warm;
+        open_stats_.last_warm = warm;
+        open_stats_.last_init_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - t0).count();
     }
-    cedarv_stream_info_t info{};
-    info.format = format;
-    info.sub_format = sub_format;
-    info.video_width = par.width; //coded_width?
-    info.video_height = par.height;
-    if (par.extra.size() > 0) {
-        info.init_data = (u8*)par.extra.data();
-        info.init_data_len = par.extra.size();
-    }
-    CEDARX_ENSURE(dec_->set_vstream_info(dec_.get(), &info), false);
-    CEDARX_ENSURE(dec_->open(dec_.get()), false);
-    dec_->ioctrl(dec_.get(), CEDARV_COMMAND_RESET, 0);
-    dec_->ioctrl(dec_.get(), CEDARV_COMMAND_PLAY, 0);
     onOpen();
     return true;
 }
 
+CedarXVideoDecoder::~CedarXVideoDecoder()
+{
+    close();
+    CedarVScheduler::instance().close(session_);
+}
+
 bool CedarXVideoDecoder::close()
 {
     if (!dec_)
         return true;
-    dec_->ioctrl(dec_.get(), CEDARV_COMMAND_STOP, 0);
-    dec_.reset();
+    stopThread();
+    recorder_.reset();
+    CedarVInstanceRef dec;
+    {
+        lock_guard<mutex> lock(ring_->mutex);
+        if (ring_->pending)
+            ring_->pending->detach();
+        dec = std::move(dec_);
+    }
+    bool idle = false;
+    {
+        lock_guard<mutex> lock(dec->mutex);
+        dec->dec->ioctrl(dec->dec, CEDARV_COMMAND_STOP, 0);
+        dec->closed = true;
+        idle = dec->pictures == 0;
+        if (idle && CedarVDecoderPool::instance().maxIdle() > 0)
+            dec->dec->ioctrl(dec->dec, CEDARV_COMMAND_JUMP, 0);
+    }
+    // otherwise pictures in flight keep the decoder, and the last released one puts it to the pool
+    if (idle && CedarVDecoderPool::instance().maxIdle() > 0)
+        CedarVDecoderPool::instance().put(std::move(dec));
     onClose();
     return true;
 }
 
+bool CedarXVideoDecoder::flush()
+{
+    seek_time_ = chrono::steady_clock::now();
+    unique_lock<mutex> lock(mutex_); // decoding thread is blocked until hardware is flushed
+    if (async_) {
+        packets_.clear();
+        queued_bytes_ = 0;
+        frames_.clear();
+        space_cv_.notify_all();
+        idle_cv_.wait(lock, [this]{ return !busy_; });
+        frames_.clear(); // decoded by the last packet
+    }
+    if (dec_) {
+        {
+            lock_guard<mutex> ring_lock(ring_->mutex);
+            if (ring_->pending) // data before seeking. ring is reset
+                ring_->pending->detach();
+        }
+        receivePictures(&ready_); // release pictures waiting for display
+        ready_.clear();
+        lock_guard<mutex> dec_lock(dec_->mutex);
+        bool jumped = true;
+        CEDARX_CHECK(dec_->dec->ioctrl(dec_->dec, CEDARV_COMMAND_JUMP, 0), jumped = false;); // reset bitstream ring, frame queue and VE
+        if (jumped) // decoding errors before seeking
+            error_ = false;
+    }
+    wait_key_ = true;
+    key_wait_packets_ = 0;
+    seeking_ = true;
+    {
+        // decoder is reset, frames after seeking are not late
+        lock_guard<mutex> skip_lock(skip_mutex_);
+        skip_level_ = skip_stats_.level = CedarXSkipNone;
+        level_packets_ = calm_packets_ = 0;
+        lateness_ms_ = 0;
+        has_pts_base_ = false;
+        drop_nonref_ = false;
+    }
+    seek_stats_.seeks++;
+    seek_stats_.last_skipped_packets = 0;
+    lock.unlock();
+    onFlush();
+    return true;
+}
+
+void CedarXVideoDecoder::frameDelivered(const vector<VideoFrame>& frames)
+{
+    const auto now = chrono::steady_clock::now();
+    const double now_ms = chrono::duration<double, milli>(now.time_since_epoch()).count();
+    unique_lock<mutex> skip_lock(skip_mutex_);
+    // lateness is wall clock - pts relative to the earliest frame. a delivery gap, e.g. pause, restarts it
+    if (now - last_delivery_ > chrono::seconds(1))
+        has_pts_base_ = false;
+    last_delivery_ = now;
+    for (const auto& f : frames) {
+        if (f.timestamp() < 0)
+            continue;
+        const double offset = now_ms - f.timestamp()*1000.0;
+        if (!has_pts_base_ || offset < pts_base_ms_) {
+            pts_base_ms_ = offset;
+            has_pts_base_ = true;
+        }
+        lateness_ms_ = offset - pts_base_ms_;
+    }
+    skip_stats_.lateness_ms = lateness_ms_;
+    skip_stats_.max_lateness_ms = std::max(skip_stats_.max_lateness_ms, lateness_ms_);
+    skip_lock.unlock();
+    if (opening_) {
+        opening_ = false;
+        const double ms = chrono::duration<double, milli>(now - open_time_).count();
+        lock_guard<mutex> lock(mutex_);
+        open_stats_.last_first_frame_ms = ms;
+        open_stats_.max_first_frame_ms = std::max(open_stats_.max_first_frame_ms, ms);
+        std::clog << "CedarX open(" << (open_stats_.last_warm ? "warm" : "cold") << " " << open_stats_.last_init_ms << "ms) to first frame: " << ms << "ms" << std::endl;
+    }
+    if (!seeking_)
+        return;
+    seeking_ = false;
+    const double ms = chrono::duration<double, milli>(now - seek_time_).count();
+    lock_guard<mutex> lock(mutex_);
+    seek_stats_.last_latency_ms = ms;
+    seek_stats_.max_latency_ms = std::max(seek_stats_.max_latency_ms, ms);
+    seek_stats_.latency_sum_ms += ms;
+    seek_stats_.completed++;
+    std::clog << "CedarX seek to first frame: " << ms << "ms, skipped packets before key frame: " << seek_stats_.last_skipped_packets << std::endl;
+}
+
 bool CedarXVideoDecoder::decode(const Packet& pkt)
 {
-    if (pkt.isEnd())
+    has_key_flags_ |= pkt.hasKeyFrame;
+    if (wait_key_ && !pkt.isEnd()) {
+        // can not be decoded correctly after flush. a stream without key frame flags, or with rare key frames is decoded anyway
+        if (!pkt.hasKeyFrame && pkt.buffer->size() > 0 && has_key_flags_ && key_wait_packets_ < max_key_wait_) {
+            key_wait_packets_++;
+            lock_guard<mutex> lock(mutex_);
+            seek_stats_.skipped_packets++;
+            seek_stats_.last_skipped_packets++;
+            return true;
+        }
+        if (!pkt.hasKeyFrame && key_wait_packets_ >= max_key_wait_)
+            std::clog << "CedarX: no key frame in " << key_wait_packets_ << " packets, decoding from a non-key frame" << std::endl;
+        wait_key_ = false;
+        key_wait_packets_ = 0;
+    }
+    if (!pkt.isEnd() && skipPacket(pkt))
+        return true;
+    status_ = CedarXDecodeOk;
+    if (!pkt.isEnd() && pkt.buffer->size() > 0 && !waitPictures()) { // not the end of stream, the caller keeps decoding
+        status_ = CedarXDecodeDropped;
+        wait_key_ = true; // the dropped packet may be a reference
+        key_wait_packets_ = 0;
+        return true;
+    }
+    if (async_)
+        return decodeAsync(pkt);
+    if (pkt.isEnd()) { // pictures decoded but not displayed yet
+        receivePictures(&ready_);
+    } else {
+        if (pkt.buffer->size() <= 0) // TODO: EOS
+            return true;
+        if (!decodePacket(pkt, &ready_))
+            return false;
+        receivePictures(&ready_);
+    }
+    if (!ready_.empty())
+        frameDelivered(ready_);
+    for (const auto& f : ready_) {
+        if (frame_cb_)
+            frame_cb_(f);
+        frameDecoded(f);
+    }
+    ready_.clear();
+    return !pkt.isEnd();
+}
+
+bool CedarXVideoDecoder::skipPacket(const Packet& pkt)
+{
+    lock_guard<mutex> lock(skip_mutex_);
+    const auto& p = skip_policy_;
+    const int depth = pics_->in_flight;
+    // decoded pictures are held by consumer
+    const bool loaded = depth >= p.high_depth || (p.late_ms > 0 && lateness_ms_ > p.late_ms && depth > p.low_depth);
+    const bool calm = depth <= p.low_depth && (p.late_ms <= 0 || lateness_ms_ < p.late_ms/2);
+    level_packets_++;
+    calm_packets_ = calm ? calm_packets_ + 1 : 0;
+    int level = skip_level_;
+    if (!p.enabled)
+        level = CedarXSkipNone;
+    else if (loaded && level < CedarXSkipNonKey && (level == CedarXSkipNone || level_packets_ >= p.recover_frames))
+        level++;
+    else if (calm && level > CedarXSkipNone && calm_packets_ >= p.recover_frames)
+        level--;
+    if (skip_level_ == CedarXSkipNonKey && level < skip_level_ && !pkt.hasKeyFrame) // references are skipped
+        level = skip_level_;
+    if (level != skip_level_) {
+        std::clog << "CedarX skip level " << skip_level_ << " => " << level << ", pictures in flight: " << depth << ", lateness: " << lateness_ms_ << "ms" << std::endl;
+        if (level > skip_level_)
+            skip_stats_.escalations++;
+        else
+            skip_stats_.recoveries++;
+        skip_level_ = skip_stats_.level = level;
+        level_packets_ = calm_packets_ = 0;
+        drop_nonref_ = level >= CedarXSkipNonRef; // applied by decoding thread
+    }
+    if (level == CedarXSkipNonKey && !pkt.hasKeyFrame) {
+        skip_stats_.nonkey_packets++;
+        return true;
+    }
+    if (level == CedarXSkipNonRef)
+        skip_stats_.nonref_packets++;
+    return false;
+}
+
+bool CedarXVideoDecoder::decodePacket(const Packet& pkt, vector<VideoFrame>* frames)
+{
+    const bool drop = drop_nonref_;
+    if (drop != drop_nonref_applied_) {
+        lock_guard<mutex> lock(dec_->mutex);
+        CEDARX_WARN(dec_->dec->ioctrl(dec_->dec, CEDARV_COMMAND_DROP_B_FRAME, drop));
+        drop_nonref_applied_ = drop;
+    }
+    if (recorder_) // pictures decoded to free ring space while writing are output by this packet too
+        record_packet_ = recorder_->nextPacket();
+    if (!writeStream(pkt, frames))
         return false;
-    if (pkt.buffer->size() <= 0) // TODO: EOS
+    CedarVScheduler::Slot slot(CedarVScheduler::instance(), arbitrate_ ? session_.get() : nullptr, pkt.buffer->size());
+    const auto t0 = chrono::steady_clock::now();
+    {
+        lock_guard<mutex> lock(dec_->mutex);
+        CedarVStageTimer t(stages_[CedarVDecode]);
+        CEDARX_ENSURE(dec_->dec->decode(dec_->dec), false);
+    }
+    if (recorder_)
+        recorder_->writePacket(record_.data(), record_.size(), pkt.pts * TimeScaleForInt, pkt.hasKeyFrame, chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - t0).count());
+    return true;
+}
+
+CedarXPictures::picture_t* CedarXPictures::get()
+{
+    {
+        lock_guard<std::mutex> lock(mutex);
+        if (!free.empty()) {
+            auto p = free.back();
+            free.pop_back();
+            p->pic = cedarv_picture_t();
+            return p;
+        }
+    }
+    allocations++;
+    return new picture_t();
+}
+
+void CedarXPictures::put(picture_t* p)
+{
+    lock_guard<std::mutex> lock(mutex);
+    free.push_back(p);
+}
+
+bool CedarXVideoDecoder::waitPictures()
+{
+    if (async_) { // frames decoded but not delivered are in flight too
+        unique_lock<mutex> lock(mutex_);
+        deliverFrames(lock);
+    }
+    if (!session_ || CedarVScheduler::instance().waitPictures(session_.get()))
         return true;
-    //dec_->ioctrl(dec_.get(), CEDARV_COMMAND_JUMP, 0);
-    u32 bufsize0, bufsize1;
-    u8 *buf0, *buf1;
-    CEDARX_ENSURE(dec_->request_write(dec_.get(), pkt.buffer->size(), &buf0, &bufsize0, &buf1, &bufsize1), false);
-    memcpy(buf0, pkt.buffer->constData(), bufsize0);
-    if ((u32)pkt.buffer->size() > bufsize0)
-        memcpy(buf1, pkt.buffer->constData() + bufsize0, bufsize1);
+    lock_guard<mutex> lock(pics_->mutex);
+    pics_->stats.budget_drops++;
+    return false;
+}
+
+int CedarXPictures::holder()
+{
+    const auto id = this_thread::get_id();
+    int i = 0;
+    lock_guard<std::mutex> lock(hold_mutex);
+    while (i < nb_holders && holders[i] != id && i < MaxConsumers - 1)
+        ++i;
+    if (i == nb_holders) {
+        holders[i] = id;
+        if (i == MaxConsumers - 1)
+            snprintf(holder_names[i], sizeof(holder_names[i]), "others");
+        else if (pthread_getname_np(pthread_self(), holder_names[i], sizeof(holder_names[i])) != 0 || !holder_names[i][0])
+            snprintf(holder_names[i], sizeof(holder_names[i]), "thread%d", i);
+        nb_holders++;
+    }
+    return i;
+}
+
+// released to the decoder requesting it, which may be closed, reopened or destroyed
+void CedarXPictures::release(cedarv_picture_t* pic)
+{
+    const auto t = chrono::steady_clock::now();
+    auto p = reinterpret_cast<picture_t*>(pic);
+    const auto dec = std::move(p->dec);
+    const auto self = std::move(p->owner); // keeps the records until returned
+    self->hold[self->holder()].add(chrono::duration_cast<chrono::nanoseconds>(t - p->decoded).count());
+    bool pool = false;
+    {
+        lock_guard<std::mutex> lock(dec->mutex);
+        dec->dec->display_release(dec->dec, pic->id);
+        pool = --dec->pictures == 0 && dec->closed && CedarVDecoderPool::instance().maxIdle() > 0;
+        if (pool)
+            dec->dec->ioctrl(dec->dec, CEDARV_COMMAND_JUMP, 0);
+    }
+    if (pool)
+        CedarVDecoderPool::instance().put(dec);
+    CedarVScheduler::SessionRef session;
+    {
+        lock_guard<std::mutex> lock(self->mutex);
+        self->free.push_back(p);
+        self->in_flight--;
+        session = self->session;
+    }
+    self->released.notify_all();
+    if (session)
+        CedarVScheduler::instance().pictureReleased(session.get());
+}
+
+uint64_t CedarXVideoDecoder::frameAllocations() const
+{
+    uint64_t n = pics_->allocations;
+    if (auto pc = dynamic_cast<CedarVPoolControl*>(pool_.get()))
+        n += pc->bufferAllocations();
+    return n;
+}
+
+int CedarXVideoDecoder::receivePictures(vector<VideoFrame>* frames)
+{
+    int n = 0;
+    while (true) {
+        auto p = pics_->get();
+        cedarv_picture_t *pic = &p->pic;
+        int ret = 0;
+        {
+            lock_guard<mutex> lock(dec_->mutex);
+            CedarVStageTimer t(stages_[CedarVDisplayRequest]);
+            ret = dec_->dec->display_request(dec_->dec, pic);
+            if (ret >= 0 && ret <= 3)
+                dec_->pictures++;
+        }
+        if (ret > 3 || ret < 0) { // < 0: no picture is ready
+            if (ret > 3) {
+                std::clog << "CedarV: display_request failed: " <<  ret << ", picture id: " << pic->id << ", pictures in flight: " << pics_->in_flight << std::endl;
+                lock_guard<mutex> lock(pics_->mutex);
+                pics_->stats.display_errors++;
+            }
+            pics_->put(p);
+            break;
+        }
+        //std::clog << "cedarv_picture_t.id: " << pic->id<< std::endl;
+        if (recorder_)
+            recorder_->writePicture(*pic, record_packet_);
+        p->decoded = chrono::steady_clock::now();
+        p->dec = dec_;
+        p->owner = pics_;
+        {
+            lock_guard<mutex> lock(pics_->mutex);
+            pics_->stats.max_in_flight = std::max<int>(pics_->stats.max_in_flight, ++pics_->in_flight);
+        }
+        auto buf = pool_->getBuffer(pic, [pic]{ // the capture fits in std::function without allocation
+            CedarXPictures::release(pic);
+        });
+        VideoFrame frame(pic->display_width, pic->display_height, PixelFormat::NV12, buf); // host map outputs yuv420p, rgb or zero copy NV12T32x32 if requested by MapParameter.format
+        frame.setTimestamp(double(pic->pts)/TimeScaleForInt);
+        frames->push_back(frame);
+        ++n;
+    }
+    if (n > 0 && session_)
+        CedarVScheduler::instance().picturesDecoded(session_.get(), n);
+    if (stats_interval_ > 0 && chrono::steady_clock::now() - stats_time_ >= chrono::seconds(stats_interval_)) {
+        stats_time_ = chrono::steady_clock::now();
+        dumpStats();
+    }
+    return n;
+}
+
+void CedarXVideoDecoder::stageStats(CedarVStageStats* stats) const
+{
+    if (auto pc = dynamic_cast<CedarVPoolControl*>(pool_.get()))
+        pc->stageStats(stats);
+    for (int i = CedarVRequestWrite; i <= CedarVDisplayRequest; ++i)
+        stats[i] = stages_[i].stats(cedarv_stage_name(i));
+}
+
+void CedarXVideoDecoder::dumpStats()
+{
+    CedarVStageStats stats[CedarVStageCount];
+    stageStats(stats);
+    auto pc = dynamic_cast<CedarVPoolControl*>(pool_.get());
+    std::clog << "CedarX stats. pictures in flight: " << pics_->in_flight << ", buffers in flight: " << (pc ? pc->buffersInFlight() : 0) << std::endl;
+    for (const auto& s : stats)
+        std::clog << "    " << s << std::endl;
+    const auto ps = pictureStats();
+    std::clog << "    pictures max in flight: " << ps.max_in_flight << ", dropped by budget: " << ps.budget_drops << ", display_request errors: " << ps.display_errors << std::endl;
+    if (invalid_nal_packets_ > 0)
+        std::clog << "    packets with invalid nal lengths: " << invalid_nal_packets_ << std::endl;
+    CedarXHoldStats hs[CedarXPictures::MaxConsumers];
+    const int nb = std::min<int>(holdStats(hs, CedarXPictures::MaxConsumers), CedarXPictures::MaxConsumers);
+    for (int i = 0; i < nb; ++i)
+        std::clog << "    hold by " << hs[i].hold << std::endl;
+    const auto sk = skipStats();
+    std::clog << "    skip level " << sk.level << ", escalations: " << sk.escalations << ", recoveries: " << sk.recoveries << ", non-ref dropping packets: " << sk.nonref_packets
+              << ", skipped non-key packets: " << sk.nonkey_packets << ", lateness: " << sk.lateness_ms << "ms, max " << sk.max_lateness_ms << "ms" << std::endl;
+    if (!session_)
+        return;
+    const auto ss = schedulingStats();
+    std::clog << "    engine share(weight " << ss.config.weight << "): " << ss.fps() << "fps, " << ss.kbps() << "kbps, busy " << ss.busy_ms << "ms, wait " << ss.wait_ms << "ms" << std::endl;
+    std::clog << "    picture budget " << ss.config.picture_budget << " waits: " << ss.budget_waits << " " << ss.budget_wait_ms << "ms, timeouts: " << ss.budget_timeouts << std::endl;
+}
+
+bool CedarXVideoDecoder::decodeAsync(const Packet& pkt)
+{
+    unique_lock<mutex> lock(mutex_);
+    if (pkt.isEnd()) {
+        idle_cv_.wait(lock, [this]{ return packets_.empty() && !busy_; });
+        receivePictures(&frames_); // decoding thread is waiting for packets
+        deliverFrames(lock);
+        return false;
+    }
+    if (pkt.buffer->size() <= 0)
+        return true;
+    const size_t bitstream_budget = session_ ? CedarVScheduler::instance().config(session_.get()).bitstream_budget : 0;
+    space_cv_.wait(lock, [&]{
+        if (stop_)
+            return true;
+        if (packets_.size() >= max_packets_)
+            return false;
+        return !bitstream_budget || packets_.empty() || queued_bytes_ + pkt.buffer->size() <= bitstream_budget;
+    });
+    if (stop_ || error_)
+        return false;
+    packets_.push_back(pkt);
+    queued_bytes_ += pkt.buffer->size();
+    stats_.packets++;
+    stats_.packet_depth_sum += packets_.size();
+    stats_.max_packet_depth = std::max<size_t>(stats_.max_packet_depth, packets_.size());
+    cv_.notify_one();
+    deliverFrames(lock);
+    return true;
+}
+
+void CedarXVideoDecoder::deliverFrames(unique_lock<mutex>& lock)
+{
+    if (frames_.empty())
+        return;
+    stats_.deliveries++;
+    stats_.frame_depth_sum += frames_.size();
+    stats_.max_frame_depth = std::max<size_t>(stats_.max_frame_depth, frames_.size());
+    ready_.swap(frames_);
+    lock.unlock(); // frameDecoded() may block
+    frameDelivered(ready_);
+    for (const auto& f : ready_) {
+        if (frame_cb_)
+            frame_cb_(f);
+        frameDecoded(f);
+    }
+    ready_.clear();
+    lock.lock();
+}
+
+void CedarXVideoDecoder::run()
+{
+    unique_lock<mutex> lock(mutex_);
+    while (true) {
+        cv_.wait(lock, [this]{ return stop_ || !packets_.empty(); });
+        if (stop_)
+            break;
+        const Packet pkt = packets_.front();
+        packets_.pop_front();
+        queued_bytes_ -= pkt.buffer->size();
+        busy_ = true;
+        space_cv_.notify_one();
+        lock.unlock();
+        const bool ok = decodePacket(pkt, &decoded_);
+        const int n = receivePictures(&decoded_);
+        lock.lock();
+        error_ |= !ok;
+        stats_.max_pictures_per_packet = std::max(stats_.max_pictures_per_packet, n);
+        for (auto& f : decoded_)
+            frames_.push_back(std::move(f));
+        decoded_.clear();
+        busy_ = false;
+        if (packets_.empty())
+            idle_cv_.notify_all();
+    }
+}
+
+void CedarXVideoDecoder::stopThread()
+{
+    if (!thread_.joinable())
+        return;
+    {
+        lock_guard<mutex> lock(mutex_);
+        stop_ = true;
+        packets_.clear();
+        queued_bytes_ = 0;
+        cv_.notify_all();
+        space_cv_.notify_all();
+    }
+    thread_.join();
+    const auto s = queueStats();
+    if (s.packets > 0)
+        std::clog << "CedarX async queues. packets: " << s.packets << ", avg depth: " << double(s.packet_depth_sum)/s.packets << ", max depth: " << s.max_packet_depth
+                  << ". frames avg depth: " << (s.deliveries ? double(s.frame_depth_sum)/s.deliveries : 0) << ", max depth: " << s.max_frame_depth
+                  << ", max pictures per packet: " << s.max_pictures_per_packet << std::endl;
+    lock_guard<mutex> lock(mutex_);
+    frames_.clear();
+    idle_cv_.notify_all();
+}
+
+CedarXQueueStats CedarXVideoDecoder::queueStats() const
+{
+    lock_guard<mutex> lock(mutex_);
+    return stats_;
+}
+
+void CedarXVideoDecoder::setScheduling(const CedarVScheduler::Config& config)
+{
+    sched_config_ = config;
+    if (session_)
+        CedarVScheduler::instance().setConfig(session_.get(), config);
+}
+
+CedarVScheduler::Stats CedarXVideoDecoder::schedulingStats() const
+{
+    if (!session_)
+        return CedarVScheduler::Stats();
+    return CedarVScheduler::instance().stats(session_.get());
+}
+
+void CedarXVideoDecoder::setSkipPolicy(const CedarXSkipPolicy& policy)
+{
+    lock_guard<mutex> lock(skip_mutex_);
+    skip_policy_ = policy;
+}
+
+CedarXPictureStats CedarXVideoDecoder::pictureStats() const
+{
+    lock_guard<mutex> lock(pics_->mutex);
+    auto s = pics_->stats;
+    s.in_flight = pics_->in_flight;
+    return s;
+}
+
+int CedarXVideoDecoder::holdStats(CedarXHoldStats* stats, int count) const
+{
+    const auto& pics = *pics_;
+    lock_guard<mutex> lock(pics.hold_mutex);
+    for (int i = 0; i < std::min(count, pics.nb_holders); ++i) {
+        memcpy(stats[i].consumer, pics.holder_names[i], sizeof(stats[i].consumer));
+        stats[i].hold = pics.hold[i].stats(stats[i].consumer);
+    }
+    return pics.nb_holders;
+}
+
+CedarXOpenStats CedarXVideoDecoder::openStats() const
+{
+    lock_guard<mutex> lock(mutex_);
+    return open_stats_;
+}
+
+CedarXSkipStats CedarXVideoDecoder::skipStats() const
+{
+    lock_guard<mutex> lock(skip_mutex_);
+    return skip_stats_;
+}
+
+CedarXSeekStats CedarXVideoDecoder::seekStats() const
+{
+    lock_guard<mutex> lock(mutex_);
+    return seek_stats_;
+}
+
+bool CedarXVideoDecoder::writeStream(const Packet& pkt, vector<VideoFrame>* frames)
+{
+    unique_lock<mutex> lock(ring_->mutex);
+    auto pb = dynamic_cast<CedarVPacketBuffer*>(pkt.buffer.get());
+    // length prefixed nal units are converted while copying, or in place if the packet is in ring, has 4 byte lengths and no parameter set is injected
+    bool convert = nal_length_size_ > 0;
+    const bool inject = convert && pkt.hasKeyFrame && !extra_.empty();
+    if (pb && ring_->pending == pb && convert && (nal_length_size_ != 4 || inject))
+        pb->detach();
+    size_t size = pkt.buffer->size();
+    if (!pb || ring_->pending != pb) {
+        if (ring_->pending) // request_write() below returns the same space
+            ring_->pending->detach();
+        // a detached packet of this decoder is in host memory. constData() locks the ring
+        const uint8_t* data = nullptr;
+        if (pb && pb->ring_ == ring_) {
+            pb->stage();
+            data = pb->host_.data();
+        } else {
+            data = pkt.buffer->constData();
+        }
+        if (convert) {
+            const size_t n = annexb_size(data, size, nal_length_size_);
+            if (n) {
+                size = n + (inject ? extra_.size() : 0);
+            } else { // annex-b already?
+                convert = false;
+                invalidNalLengths(pkt);
+            }
+        }
+        u32 bufsize0 = 0, bufsize1 = 0;
+        u8 *buf0 = nullptr, *buf1 = nullptr;
+        int ret = 0;
+        {
+            lock_guard<mutex> dec_lock(dec_->mutex);
+            CedarVStageTimer t(stages_[CedarVRequestWrite]);
+            ret = dec_->dec->request_write(dec_->dec, size, &buf0, &bufsize0, &buf1, &bufsize1);
+        }
+        if (ret < 0 || !buf0 || bufsize0 + (buf1 ? bufsize1 : 0) < size) { // larger than free space
+            if (!convert)
+                return writeChunks(pkt, data, size, lock, frames);
+            annexb_.resize(size);
+            ring_writer w{{annexb_.data(), nullptr}, {size, 0}, 0};
+            if (inject)
+                w.write(extra_.data(), extra_.size());
+            write_annexb(w, data, pkt.buffer->size(), nal_length_size_);
+            return writeChunks(pkt, annexb_.data(), size, lock, frames);
+        }
+        CedarVStageTimer t(stages_[CedarVStreamCopy], size);
+        const size_t size0 = std::min<size_t>(bufsize0, size);
+        if (convert) {
+            ring_writer w{{buf0, buf1}, {size0, size - size0}, 0};
+            if (inject)
+                w.write(extra_.data(), extra_.size());
+            write_annexb(w, data, pkt.buffer->size(), nal_length_size_);
+        } else {
+            memcpy(buf0, data, size0);
+            if (size > size0)
+                memcpy(buf1, data + size0, size - size0);
+        }
+        recordStream(buf0, size0, buf1, size);
+    } else { // already in ring
+        if (!pb->host_.empty()) { // staged by data() because of wrap around
+            CedarVStageTimer t(stages_[CedarVStreamCopy], pb->size_);
+            memcpy(pb->part_[0], pb->host_.data(), std::min(pb->part_size_[0], pb->size_));
+            if (pb->size_ > pb->part_size_[0])
+                memcpy(pb->part_[1], pb->host_.data() + pb->part_size_[0], pb->size_ - pb->part_size_[0]);
+        }
+        if (convert && !annexb_in_place(pb->part_[0], pb->part_size_[0], pb->part_[1], pb->size_)) // nothing is changed
+            invalidNalLengths(pkt);
+        size = pb->size_;
+        recordStream(pb->part_[0], pb->part_size_[0], pb->part_[1], size);
+        ring_->pending = nullptr;
+    }
     cedarv_stream_data_info_t info;
     info.type = 0; // TODO
-    info.lengh = pkt.buffer->size();
+    info.lengh = size;
     info.pts = pkt.pts * TimeScaleForInt;
     info.flags = CEDARV_FLAG_FIRST_PART | CEDARV_FLAG_LAST_PART | CEDARV_FLAG_PTS_VALID;
-    CEDARX_ENSURE(dec_->update_data(dec_.get(), &info), false);
-    CEDARX_ENSURE(dec_->decode(dec_.get()), false);
-    cedarv_picture_t *pic = new cedarv_picture_t();
-    auto ret = dec_->display_request(dec_.get(), pic);
-    if (ret > 3 || ret < 0) {
-        std::clog << "CedarV: display_request failed: " <<  ret << ", picture id: " << pic->id << std::endl;
-        delete pic;
-        return true; // do not treat as error because FrameReader will stop decoding if decode returns false. why ret == -1 at the beginning?
-    }
-    //std::clog << "cedarv_picture_t.id: " << pic->id<< std::endl;
-    auto buf = pool_->getBuffer(pic, [pic, this]{ // TODO: shared_ptr<dec_>
-        dec_->display_release(dec_.get(), pic->id);
-        delete pic;
-    });
-    VideoFrame frame(pic->display_width, pic->display_height, PixelFormat::NV12, buf); // TODO: can be mapped as yuv420p, rgb24
-    frame.setTimestamp(double(pic->pts)/TimeScaleForInt);
-    frameDecoded(frame);
-    return !pkt.isEnd();
+    lock_guard<mutex> dec_lock(dec_->mutex);
+    CedarVStageTimer t(stages_[CedarVUpdateData]);
+    CEDARX_ENSURE(dec_->dec->update_data(dec_->dec, &info), false);
+    return true;
+}
+
+// a part of a frame is kept in ring until the last part arrives, while decoding consumes previous frames
+bool CedarXVideoDecoder::writeChunks(const Packet& pkt, const uint8_t* data, size_t size, unique_lock<mutex>& ring_lock, vector<VideoFrame>* frames)
+{
+    static const size_t kMinChunk = 16 << 10;
+    static const int kMaxStalls = 32;
+    size_t offset = 0;
+    size_t chunk = std::max<size_t>(size/2, 1); // a packet smaller than 2 bytes is written in 1 piece
+    int stalls = 0;
+    recordStream(data, size, nullptr, size);
+    while (offset < size) {
+        const size_t n = std::min(chunk, size - offset);
+        u32 bufsize0 = 0, bufsize1 = 0;
+        u8 *buf0 = nullptr, *buf1 = nullptr;
+        int ret = -1;
+        if (n > 0) { // no progress is a stall
+            lock_guard<mutex> dec_lock(dec_->mutex);
+            CedarVStageTimer t(stages_[CedarVRequestWrite]);
+            ret = dec_->dec->request_write(dec_->dec, n, &buf0, &bufsize0, &buf1, &bufsize1);
+        }
+        if (ret < 0 || !buf0 || bufsize0 + (buf1 ? bufsize1 : 0) < n) {
+            if (n > 0 && chunk > kMinChunk) {
+                chunk = std::max(chunk/2, kMinChunk);
+                continue;
+            }
+            if (++stalls > kMaxStalls) {
+                std::clog << "CedarV: no bitstream space for " << size - offset << "/" << size << " bytes" << std::endl;
+                if (offset > 0) { // drop the incomplete frame in ring, and the following frames until a key frame
+                    lock_guard<mutex> dec_lock(dec_->mutex);
+                    CEDARX_WARN(dec_->dec->ioctrl(dec_->dec, CEDARV_COMMAND_JUMP, 0));
+                    wait_key_ = true;
+                }
+                return false;
+            }
+            // decode queued frames to free space, and take decoded pictures out of the frame queue. ring is unlocked while waiting for engine and decoding
+            ring_lock.unlock();
+            {
+                CedarVScheduler::Slot slot(CedarVScheduler::instance(), arbitrate_ ? session_.get() : nullptr);
+                lock_guard<mutex> dec_lock(dec_->mutex);
+                CedarVStageTimer t(stages_[CedarVDecode]);
+                CEDARX_WARN(dec_->dec->decode(dec_->dec));
+            }
+            receivePictures(frames);
+            ring_lock.lock();
+            if (ring_->pending) // allocated by another thread meanwhile, request_write() returns the same space
+                ring_->pending->detach();
+            continue;
+        }
+        {
+            CedarVStageTimer t(stages_[CedarVStreamCopy], n);
+            const size_t size0 = std::min<size_t>(bufsize0, n);
+            memcpy(buf0, data + offset, size0);
+            if (n > size0)
+                memcpy(buf1, data + offset + size0, n - size0);
+        }
+        cedarv_stream_data_info_t info{}; // type 0: the major video stream
+        info.lengh = n;
+        info.pts = pkt.pts * TimeScaleForInt;
+        info.flags = (offset == 0 ? CEDARV_FLAG_FIRST_PART | CEDARV_FLAG_PTS_VALID : 0) | (offset + n == size ? CEDARV_FLAG_LAST_PART : 0);
+        lock_guard<mutex> dec_lock(dec_->mutex);
+        CedarVStageTimer t(stages_[CedarVUpdateData]);
+        CEDARX_ENSURE(dec_->dec->update_data(dec_->dec, &info), false);
+        offset += n;
+    }
+    return true;
+}
+
+void CedarXVideoDecoder::recordStream(const uint8_t* part0, size_t size0, const uint8_t* part1, size_t size)
+{
+    if (!recorder_)
+        return;
+    size0 = std::min(size0, size);
+    record_.assign(part0, part0 + size0);
+    if (size > size0)
+        record_.insert(record_.end(), part1, part1 + size - size0);
+}
+
+void CedarXVideoDecoder::invalidNalLengths(const Packet& pkt)
+{
+    if (invalid_nal_packets_++ == 0) // once, maybe annex-b in avcC stream
+        std::clog << "CedarX: invalid " << nal_length_size_ << " byte nal lengths in packet of " << pkt.buffer->size() << " bytes, pts " << pkt.pts << ". submitted without conversion" << std::endl;
+}
+
+BufferRef CedarXVideoDecoder::allocatePacket(size_t size)
+{
+    lock_guard<mutex> lock(ring_->mutex);
+    if (!dec_ || size == 0)
+        return nullptr;
+    if (async_) // decoding thread writes the ring for queued packets, so the space returned by request_write() is not reserved
+        return BufferRef(new CedarVPacketBuffer(ring_, nullptr, 0, nullptr, size));
+    if (ring_->pending)
+        ring_->pending->detach();
+    u32 bufsize0 = 0, bufsize1 = 0;
+    u8 *buf0 = nullptr, *buf1 = nullptr;
+    {
+        lock_guard<mutex> dec_lock(dec_->mutex);
+        CedarVStageTimer t(stages_[CedarVRequestWrite]);
+        CEDARX_ENSURE(dec_->dec->request_write(dec_->dec, size, &buf0, &bufsize0, &buf1, &bufsize1), nullptr);
+    }
+    if (!buf0 || bufsize0 + (buf1 ? bufsize1 : 0) < size)
+        return nullptr;
+    auto pb = new CedarVPacketBuffer(ring_, buf0, bufsize0, buf1, size);
+    ring_->pending = pb;
+    return BufferRef(pb);
+}
+
+CedarVPacketBuffer::CedarVPacketBuffer(shared_ptr<CedarVStreamRing> ring, uint8_t* part0, size_t size0, uint8_t* part1, size_t size)
+    : ring_(ring)
+    , part_{part0, part1}
+    , part_size_{part0 ? std::min(size0, size) : 0, part0 && size > size0 ? size - size0 : 0}
+    , size_(size)
+{
+    if (!part0)
+        host_.resize(size);
+}
+
+CedarVPacketBuffer::~CedarVPacketBuffer()
+{
+    lock_guard<mutex> lock(ring_->mutex);
+    if (ring_->pending == this) // unused space is returned by next request_write()
+        ring_->pending = nullptr;
+}
+
+const uint8_t* CedarVPacketBuffer::constData() const
+{
+    return const_cast<CedarVPacketBuffer*>(this)->data();
+}
+
+uint8_t* CedarVPacketBuffer::data()
+{
+    lock_guard<mutex> lock(ring_->mutex);
+    if (host_.empty() && part_[0] && size_ <= part_size_[0])
+        return part_[0];
+    stage();
+    return host_.data();
+}
+
+uint8_t* CedarVPacketBuffer::part(int index, size_t* size)
+{
+    lock_guard<mutex> lock(ring_->mutex);
+    if (!host_.empty() || index < 0 || index > 1 || !part_size_[index]) {
+        if (size)
+            *size = 0;
+        return nullptr;
+    }
+    if (size)
+        *size = part_size_[index];
+    return part_[index];
+}
+
+void CedarVPacketBuffer::write(size_t offset, const void* data, size_t len)
+{
+    lock_guard<mutex> lock(ring_->mutex);
+    len = std::min(len, size_ - std::min(offset, size_));
+    if (!host_.empty()) {
+        memcpy(host_.data() + offset, data, len);
+        return;
+    }
+    const auto src = (const uint8_t*)data;
+    if (offset < part_size_[0]) {
+        const size_t n = std::min(len, part_size_[0] - offset);
+        memcpy(part_[0] + offset, src, n);
+        offset += n;
+        len -= n;
+        if (!len)
+            return;
+        memcpy(part_[1], src + n, len);
+        return;
+    }
+    memcpy(part_[1] + offset - part_size_[0], src, len);
+}
+
+void CedarVPacketBuffer::shrink(size_t size)
+{
+    lock_guard<mutex> lock(ring_->mutex);
+    if (size >= size_)
+        return;
+    size_ = size;
+    part_size_[0] = std::min(part_size_[0], size);
+    part_size_[1] = size - part_size_[0];
+    if (!host_.empty())
+        host_.resize(size);
+}
+
+void CedarVPacketBuffer::detach()
+{
+    stage();
+    part_[0] = part_[1] = nullptr;
+    part_size_[0] = part_size_[1] = 0;
+    ring_->pending = nullptr;
+}
+
+void CedarVPacketBuffer::stage()
+{
+    if (!host_.empty() || !size_)
+        return;
+    host_.resize(size_);
+    if (!part_[0])
+        return;
+    memcpy(host_.data(), part_[0], part_size_[0]);
+    if (part_size_[1])
+        memcpy(host_.data() + part_size_[0], part_[1], part_size_[1]);
 }
 
 void register_video_decoders_cedarx() {
@@ -0,0 +1,162 @@
+/*
+ * Copyright (c) 2018-2020 WangBin <wbsecg1 at gmail.com>
+ */
+// CedarX decoder specific api, e.g.
+// \code
+//   if (auto cedarx = dynamic_cast<CedarXDecoderControl*>(decoder))
+//       pkt.buffer = cedarx->allocatePacket(size);
+// \endcode
+#pragma once
+#include "mdk/Packet.h"
+#include "video/hwa/CedarVStats.h"
+#include "CedarVScheduler.h"
+#include <functional>
+#include <memory>
+
+MDK_NS_BEGIN
+class VideoFrame;
+struct CedarVStreamRing;
+/*!
+  compressed data in CedarV bitstream ring. decode() commits it without copy if it's the last allocated packet of the decoder.
+  fill it before allocating the next packet, otherwise the data is moved to host memory and copied to the ring again when decoding
+  in async mode it's always host memory, copied to the ring by the decoding thread
+  length prefixed h264(avcC) is converted to annex-b in place, or copied if nal length size is not 4 or parameter sets are injected to a key frame
+ */
+class CedarVPacketBuffer final : public Buffer {
+public:
+    ~CedarVPacketBuffer() override;
+    const uint8_t* constData() const override;
+    // contiguous memory. if the reservation wraps around the ring end, it's host memory copied to the ring when decoding
+    uint8_t* data() override;
+    size_t size() const override { return size_; }
+    // ring parts to write directly, part 1 is used only if part 0 is smaller than size(). null if not in ring
+    uint8_t* part(int index, size_t* size);
+    // copy to offset, wraps around the ring end if needed
+    void write(size_t offset, const void* data, size_t len);
+    // commit less data than allocated
+    void shrink(size_t size);
+private:
+    friend class CedarXVideoDecoder;
+    CedarVPacketBuffer(std::shared_ptr<CedarVStreamRing> ring, uint8_t* part0, size_t size0, uint8_t* part1, size_t size);
+    void detach(); // move data to host memory. ring is locked
+    void stage();
+
+    std::shared_ptr<CedarVStreamRing> ring_;
+    uint8_t* part_[2];
+    size_t part_size_[2];
+    size_t size_;
+    std::vector<uint8_t> host_; // not empty if data is in host memory
+};
+
+// async decoding queue depths, sampled when a packet is queued and when frames are delivered
+struct CedarXQueueStats {
+    uint64_t packets = 0; // queued packets
+    uint64_t packet_depth_sum = 0;
+    size_t max_packet_depth = 0;
+    uint64_t deliveries = 0; // decode() calls delivering frames
+    uint64_t frame_depth_sum = 0;
+    size_t max_frame_depth = 0;
+    int max_pictures_per_packet = 0;
+};
+
+// flush() to the first delivered frame
+struct CedarXSeekStats {
+    uint64_t seeks = 0; // flush() calls
+    uint64_t completed = 0; // seeks followed by a frame
+    double last_latency_ms = 0;
+    double max_latency_ms = 0;
+    double latency_sum_ms = 0;
+    uint64_t skipped_packets = 0; // non-key packets after flush
+    uint64_t last_skipped_packets = 0;
+};
+
+enum CedarXSkipLevel {
+    CedarXSkipNone,
+    CedarXSkipNonRef, // non-reference frames are dropped by decoder
+    CedarXSkipNonKey, // only key frames are decoded
+};
+
+// load adaptive frame skipping. skips more if decoded pictures are not released by consumer, or frames are late while pictures are held.
+// a slow decoder itself does not trigger skipping, e.g. transcoding slower than realtime
+struct CedarXSkipPolicy {
+    bool enabled = true;
+    int high_depth = 5; // pictures in flight to skip more
+    int low_depth = 2; // pictures in flight to skip less
+    int late_ms = 100; // frame pts lateness to wall clock to skip more if pictures in flight > low_depth. 0: disabled
+    int recover_frames = 8; // delivered frames without load to skip less, also min frames between 2 escalations
+};
+
+struct CedarXSkipStats {
+    int level = CedarXSkipNone;
+    uint64_t escalations = 0;
+    uint64_t recoveries = 0;
+    uint64_t nonref_packets = 0; // decoded with non-reference frames dropped
+    uint64_t nonkey_packets = 0; // skipped non-key packets
+    double lateness_ms = 0; // last delivered frame
+    double max_lateness_ms = 0;
+};
+
+// budget waits are in CedarVScheduler::Stats
+struct CedarXPictureStats {
+    int in_flight = 0;
+    int max_in_flight = 0;
+    uint64_t budget_drops = 0; // decode() returned CedarXDecodeDropped
+    uint64_t display_errors = 0; // display_request() failures
+};
+
+// hold time from decoded to released, by the thread releasing the last reference, i.e. the last consumer
+struct CedarXHoldStats {
+    char consumer[16]; // thread name
+    CedarVStageStats hold;
+};
+
+enum CedarXDecodeStatus {
+    CedarXDecodeOk,
+    CedarXDecodeDropped, // picture budget is exceeded after timeout, packet is dropped and decoding resumes from the next key frame. decode() returns true
+    CedarXDecodeError,
+};
+
+// open() to the first delivered frame. a warm open reuses an initialized decoder closed by another CedarX decoder
+struct CedarXOpenStats {
+    uint64_t opens = 0;
+    uint64_t warm_opens = 0;
+    bool last_warm = false;
+    double last_init_ms = 0; // time of open()
+    double last_first_frame_ms = 0;
+    double max_first_frame_ms = 0;
+};
+
+class CedarXDecoderControl {
+public:
+    virtual ~CedarXDecoderControl() = default;
+    // a packet buffer in the decoder's bitstream ring(host memory in async mode), or null if the decoder is not open or the ring is full. thread safe
+    virtual BufferRef allocatePacket(size_t size) = 0;
+    // statistics since open. thread safe
+    virtual CedarXQueueStats queueStats() const = 0;
+    virtual CedarXSeekStats seekStats() const = 0;
+    // heap allocations of picture records and CedarV buffers. does not increase after warm up
+    virtual uint64_t frameAllocations() const = 0;
+    // CedarVStageCount stats of decoder and pool stages. thread safe
+    virtual void stageStats(CedarVStageStats* stats) const = 0;
+    virtual int picturesInFlight() const = 0; // requested by display_request() and not released
+    // video engine share with other decoders and picture budget. decoded pictures not released by consumers are not available to the hardware,
+    // decode() waits for consumers if the budget is exceeded. weight and budgets can be changed at any time
+    virtual void setScheduling(const CedarVScheduler::Config& config) = 0;
+    virtual CedarVScheduler::Stats schedulingStats() const = 0;
+    virtual void setSkipPolicy(const CedarXSkipPolicy& policy) = 0;
+    virtual CedarXSkipStats skipStats() const = 0;
+    virtual CedarXPictureStats pictureStats() const = 0;
+    // returns the number of consumers, stats are filled up to count
+    virtual int holdStats(CedarXHoldStats* stats, int count) const = 0;
+    virtual CedarXDecodeStatus lastDecodeStatus() const = 0; // result of the last decode() call
+    virtual CedarXOpenStats openStats() const = 0;
+};
+
+// benchmark api of a decoder replaying a capture(CEDARX_REPLAY), e.g. cedarv_replay_bench. not used by hardware decoding
+class CedarXReplayControl {
+public:
+    virtual ~CedarXReplayControl() = default;
+    // called in the thread delivering frames, before a frame is delivered to the decoder's consumer. set it before decoding. ignored if the decoder is not replaying
+    virtual void setFrameCallback(std::function<void(const VideoFrame&)> cb) = 0;
+};
+MDK_NS_END
@@ -0,0 +1,222 @@
+/*
+ * Copyright (c) 2018-2020 WangBin <wbsecg1 at gmail.com>
+ */
+// end to end benchmark on a capture(CEDARX_RECORD=file): CedarXVideoDecoder replays it(CEDARX_REPLAY), packets are written by allocatePacket(),
+// and decoded frames are mapped to host memory by CedarVBufferPool.
+// build: not built by the project. it needs the mdk internal headers(mdk/VideoDecoder.h etc.) and library of the mdk source tree containing video/,
+// so run in that tree's src directory. ump_stub.cpp replaces libUMP if there is no UMP driver, tiled_yuv.S is for armv7 only:
+//   c++ -O2 -std=c++14 -pthread -I. -I/path/to/libcedarv/include -I/path/to/ump/include -Ivideo/hwa video/codec/cedarv_replay_bench.cpp
+//     video/codec/CedarXVideoDecoder.cpp video/codec/CedarVScheduler.cpp video/codec/CedarVCapture.cpp video/hwa/CedarVBuffer.cpp video/hwa/tiled_yuv.cpp
+//     [video/hwa/tiled_yuv.S] video/hwa/ump_stub.cpp -L/path/to/mdk/lib -lmdk -lEGL -lGLESv2 -o cedarv_replay_bench
+// usage: cedarv_replay_bench file [-s speed] [-l loops] [-t threads] [-k kernel] [-f nv12|yuv420p|rgba]
+//        cedarv_replay_bench -g WxH[,frames] file: write a synthetic capture
+// decoder and pool env vars are applied, e.g. CEDARX_ASYNC=1, CEDARV_PREFETCH=2. exit code is not 0 if a packet or frame fails
+#include "CedarVCapture.h"
+#include "CedarXVideoDecoder.h"
+#include "CedarVBuffer.h"
+#include "mdk/MediaInfo.h"
+#include "mdk/VideoDecoder.h"
+#include "mdk/VideoFrame.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+using namespace std;
+using namespace MDK_NS;
+
+static uint64_t now_ns()
+{
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+struct latency {
+    const char* name;
+    vector<uint64_t> ns;
+    uint64_t bytes = 0;
+
+    explicit latency(const char* n) : name(n) {}
+
+    void print() {
+        if (ns.empty()) {
+            printf("%-16s 0\n", name);
+            return;
+        }
+        sort(ns.begin(), ns.end());
+        uint64_t total = 0;
+        for (auto v : ns)
+            total += v;
+        printf("%-16s %8zu, avg %8.1fus, p50 %8.1fus, p99 %8.1fus, max %8.1fus", name, ns.size(), total/1000.0/ns.size(),
+               ns[ns.size()/2]/1000.0, ns[min(ns.size() - 1, ns.size()*99/100)]/1000.0, ns.back()/1000.0);
+        if (bytes && total)
+            printf(", %.1f MB/s", double(bytes)*1000.0/total);
+        printf("\n");
+    }
+};
+
+// synthetic tiled pictures, 1 packet per picture, 60fps pts and 5ms decode time. codec is any supported by CedarXVideoDecoder, replayed data are not parsed
+static int generate(const char* path, unsigned w, unsigned h, int frames)
+{
+    CedarVCaptureWriter writer;
+    if (!writer.open(path, "mpeg2", w, h, nullptr, 0))
+        return 1;
+    const unsigned pitch = (w + 31) & ~31u;
+    vector<u8> y(pitch*((h + 31) & ~31u)), uv(pitch*((h/2 + 31) & ~31u));
+    unsigned seed = w*65599 + h;
+    for (auto& c : y)
+        c = (u8)((seed = seed*1103515245 + 12345) >> 16);
+    for (auto& c : uv)
+        c = (u8)((seed = seed*1103515245 + 12345) >> 16);
+    vector<u8> packet(max(w*h/20, 1u), 0);
+    for (int i = 0; i < frames; ++i) {
+        const int64_t pts = int64_t(i)*1000000/60;
+        writer.writePacket(packet.data(), packet.size(), pts, i % 30 == 0, 5000000);
+        cedarv_picture_t pic{};
+        pic.width = pic.display_width = w;
+        pic.height = pic.display_height = h;
+        pic.pts = pts;
+        pic.y = y.data();
+        pic.u = uv.data();
+        pic.size_y = (u32)y.size();
+        pic.size_u = (u32)uv.size();
+        writer.writePicture(pic, i);
+    }
+    printf("%s: %d synthetic %ux%u pictures\n", path, frames, w, h);
+    return 0;
+}
+
+int main(int argc, char* argv[])
+{
+    const char* path = nullptr;
+    const char* speed = "0";
+    int loops = 1;
+    const char* threads = "1";
+    const char* kernel = nullptr;
+    PixelFormat format = PixelFormat::YUV420P;
+    unsigned gen_w = 0, gen_h = 0;
+    int gen_frames = 300;
+    for (int i = 1; i < argc; ++i) {
+        const char* a = argv[i];
+        const char* v = i + 1 < argc ? argv[i+1] : nullptr;
+        if (a[0] != '-') {
+            path = a;
+            continue;
+        }
+        if (!strcmp(a, "-s") && v) {
+            speed = v;
+        } else if (!strcmp(a, "-l") && v) {
+            loops = max(atoi(v), 1);
+        } else if (!strcmp(a, "-t") && v) {
+            threads = v;
+        } else if (!strcmp(a, "-k") && v) {
+            kernel = v;
+        } else if (!strcmp(a, "-f") && v) {
+            format = !strcmp(v, "nv12") ? PixelFormat::NV12 : !strcmp(v, "rgba") ? PixelFormat::RGBA : PixelFormat::YUV420P;
+        } else if (!strcmp(a, "-g") && v) {
+            sscanf(v, "%ux%u,%d", &gen_w, &gen_h, &gen_frames);
+        } else {
+            path = nullptr;
+            break;
+        }
+        ++i;
+    }
+    if (!path) {
+        printf("usage: %s file [-s speed] [-l loops] [-t threads] [-k kernel] [-f nv12|yuv420p|rgba]\n"
+               "       %s -g WxH[,frames] file\n", argv[0], argv[0]);
+        return 0;
+    }
+    if (gen_w && gen_h)
+        return generate(path, gen_w & ~1u, gen_h & ~1u, gen_frames);
+
+    auto file = make_shared<CedarVCaptureFile>();
+    if (!file->open(path) || !file->packets())
+        return 1;
+    const auto& hdr = file->header();
+    // read by the decoder and pool when created. every packet is decoded
+    setenv("CEDARX_REPLAY", path, 1);
+    setenv("CEDARX_REPLAY_SPEED", speed, 1);
+    setenv("CEDARX_SKIP", "0", 0);
+    setenv("TILE_THREADS", threads, 1);
+    if (kernel)
+        setenv("SIMD_TILE", kernel, 1);
+    unique_ptr<VideoDecoder> dec(VideoDecoder::create("CedarX"));
+    auto cedarx = dynamic_cast<CedarXDecoderControl*>(dec.get());
+    auto replay = dynamic_cast<CedarXReplayControl*>(dec.get());
+    if (!cedarx || !replay) {
+        printf("CedarX decoder is not available\n");
+        return 1;
+    }
+    VideoCodecParameters par;
+    par.codec = hdr.codec;
+    par.width = hdr.width;
+    par.height = hdr.height;
+    par.extra.assign(file->extra(), file->extra() + hdr.extra_size);
+    dec->setParameters(par);
+    if (!dec->open())
+        return 1;
+    printf("%s %ux%u, kernels: %s, threads: %s, speed: %s, loops: %d\n", hdr.codec, hdr.width, hdr.height, kernel ? kernel : "auto", threads, speed, loops);
+
+    latency write{"packet_write"}, decode{"decode"}, map{"host_map"}, frame{"packet_to_host"};
+    int errors = 0;
+    uint64_t pictures = 0;
+    uint64_t tp = 0; // current packet
+    replay->setFrameCallback([&](const VideoFrame& f) {
+        const uint64_t t1 = now_ns();
+        const VideoFrame host = f.to(format); // CedarVBufferPool host map
+        const uint64_t t2 = now_ns();
+        if (!host) {
+            ++errors;
+            return;
+        }
+        map.ns.push_back(t2 - t1);
+        const size_t pixels = size_t(f.width())*f.height();
+        map.bytes += format == PixelFormat::RGBA ? pixels*4 : pixels*3/2;
+        frame.ns.push_back(t2 - tp);
+        ++pictures;
+    });
+    const uint64_t t0 = now_ns();
+    for (int l = 0; l < loops; ++l) {
+        for (size_t i = 0; i < file->packets(); ++i) {
+            const auto& r = file->packet(i);
+            if (!r.data_size)
+                continue;
+            tp = now_ns();
+            // in the decoder's bitstream ring(host memory in async mode)
+            auto buf = cedarx->allocatePacket(r.data_size);
+            if (!buf) {
+                ++errors;
+                continue;
+            }
+            static_cast<CedarVPacketBuffer*>(buf.get())->write(0, CedarVCaptureFile::data(r), r.data_size);
+            Packet pkt;
+            pkt.buffer = buf;
+            pkt.pts = double(r.pts)/TimeScaleForInt;
+            pkt.hasKeyFrame = r.flags & 1;
+            const uint64_t td = now_ns();
+            write.ns.push_back(td - tp);
+            write.bytes += r.data_size;
+            if (!dec->decode(pkt))
+                ++errors;
+            decode.ns.push_back(now_ns() - td); // including host maps of frames delivered in decode()
+        }
+    }
+    const double s = (now_ns() - t0)/1e9;
+    printf("pictures: %llu, %.3fs, %.1f fps\n", (unsigned long long)pictures, s, s > 0 ? pictures/s : 0);
+    for (auto l : {&write, &decode, &map, &frame})
+        l->print();
+    CedarVStageStats stats[CedarVStageCount];
+    cedarx->stageStats(stats);
+    for (const auto& st : stats) {
+        if (st.name) // pool stages are empty if the pool is not CedarV
+            cout << "    " << st << endl;
+    }
+    dec->close();
+    if (errors)
+        printf("FAILED: %d packets or frames\n", errors);
+    return errors;
+}
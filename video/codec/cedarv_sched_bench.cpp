@@ -0,0 +1,212 @@
+/*
+ * Copyright (c) 2018-2020 WangBin <wbsecg1 at gmail.com>
+ */
+// CedarVScheduler checks with fake decode functions:
+//   shares: sessions of different weights decode concurrently, engine time shares must match weights
+//   idle: a session starting to decode after idle for a while must not take the engine to catch up
+//   budget: decoded pictures are released slowly or never, picture budget waits, timeouts and drops are checked
+// build in video/codec, not built by the project. only mdk/global.h of mdk sdk or source tree is required:
+//   c++ -O2 -std=c++11 -pthread -I/path/to/mdk/include cedarv_sched_bench.cpp CedarVScheduler.cpp -o cedarv_sched_bench
+// usage: cedarv_sched_bench [-w weights(default 1,2,4)] [-d decode_ms(default 2)] [-s seconds(default 2)]
+// exit code is the number of failed checks
+#include "CedarVScheduler.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+using namespace std;
+using namespace MDK_NS;
+using clock_type = chrono::steady_clock;
+
+static int failures = 0;
+
+static void check(bool ok, const char* what)
+{
+    printf("%s: %s\n", ok ? "PASS" : "FAIL", what);
+    failures += !ok;
+}
+
+static double elapsed_ms(clock_type::time_point t0)
+{
+    return chrono::duration<double, milli>(clock_type::now() - t0).count();
+}
+
+// every session decodes as fast as it can in its own thread
+static void test_shares(const vector<int>& weights, int decode_ms, double seconds)
+{
+    auto& sched = CedarVScheduler::instance();
+    vector<CedarVScheduler::SessionRef> sessions;
+    for (size_t i = 0; i < weights.size(); ++i) {
+        CedarVScheduler::Config c;
+        c.weight = weights[i];
+        sessions.push_back(sched.open("weight " + to_string(weights[i]) + " #" + to_string(i), c));
+    }
+    atomic<bool> stop{false};
+    vector<thread> threads;
+    for (auto& s : sessions) {
+        threads.emplace_back([&, s]{
+            while (!stop) {
+                CedarVScheduler::Slot slot(sched, s.get(), 1000);
+                this_thread::sleep_for(chrono::milliseconds(decode_ms)); // fake decode()
+            }
+        });
+    }
+    this_thread::sleep_for(chrono::duration<double>(seconds));
+    stop = true;
+    for (auto& t : threads)
+        t.join();
+    double busy = 0, weight = 0;
+    vector<CedarVScheduler::Stats> stats;
+    for (auto& s : sessions) {
+        stats.push_back(sched.stats(s.get()));
+        busy += stats.back().busy_ms;
+        weight += stats.back().config.weight;
+    }
+    // a session may be 1 decode behind its share when stopped
+    const double tolerance = std::max(0.05, 2.0*decode_ms*sessions.size()/busy);
+    bool ok = busy > 0;
+    for (const auto& st : stats) {
+        const double share = busy > 0 ? st.busy_ms/busy : 0;
+        const double expected = st.config.weight/weight;
+        printf("    %-12s decodes: %6llu, busy %8.1fms, wait %8.1fms, share %.3f, expected %.3f\n", st.name.data(), (unsigned long long)st.decodes, st.busy_ms, st.wait_ms, share, expected);
+        ok &= fabs(share - expected) <= tolerance;
+    }
+    char what[64];
+    snprintf(what, sizeof(what), "engine shares of %zu sessions match weights", sessions.size());
+    check(ok, what);
+    for (auto& s : sessions)
+        sched.close(s);
+}
+
+// 2 sessions of equal weight. the 2nd is idle in the 1st half, then both decode the same number of times in the 2nd half
+static void test_idle(int decode_ms, double seconds)
+{
+    auto& sched = CedarVScheduler::instance();
+    auto busy = sched.open("busy", CedarVScheduler::Config());
+    auto idle = sched.open("idle", CedarVScheduler::Config());
+    atomic<bool> stop{false};
+    atomic<int> busy_decodes{0}, busy_at_start{-1};
+    int idle_decodes = 0;
+    thread t([&]{
+        while (!stop) {
+            CedarVScheduler::Slot slot(sched, busy.get());
+            this_thread::sleep_for(chrono::milliseconds(decode_ms));
+            busy_decodes++;
+        }
+    });
+    this_thread::sleep_for(chrono::duration<double>(seconds/2));
+    busy_at_start = busy_decodes.load();
+    const auto t0 = clock_type::now();
+    while (elapsed_ms(t0) < seconds*500) {
+        CedarVScheduler::Slot slot(sched, idle.get());
+        this_thread::sleep_for(chrono::milliseconds(decode_ms));
+        idle_decodes++;
+    }
+    stop = true;
+    t.join();
+    sched.close(busy);
+    sched.close(idle);
+    const int busy_after = busy_decodes - busy_at_start;
+    printf("    decodes after the idle session starts. busy: %d, idle: %d\n", busy_after, idle_decodes);
+    check(busy_after > 0 && abs(busy_after - idle_decodes) <= std::max(2, idle_decodes/10), "an idle session does not catch up");
+}
+
+// 1 picture per fake decode. the consumer releases a picture every release_ms, or never if release_ms < 0
+static void test_budget(int budget, int timeout_ms, bool drop, int release_ms, int packets)
+{
+    auto& sched = CedarVScheduler::instance();
+    CedarVScheduler::Config c;
+    c.picture_budget = budget;
+    c.picture_timeout_ms = timeout_ms;
+    c.drop = drop;
+    auto s = sched.open("budget", c);
+    atomic<int> held{0}, max_held{0}, dropped{0};
+    atomic<bool> stop{false};
+    thread consumer;
+    if (release_ms >= 0) {
+        consumer = thread([&]{
+            while (!stop || held > 0) {
+                this_thread::sleep_for(chrono::milliseconds(release_ms));
+                if (held > 0) {
+                    held--;
+                    sched.pictureReleased(s.get());
+                }
+            }
+        });
+    }
+    double max_wait_ms = 0;
+    for (int i = 0; i < packets; ++i) {
+        const auto t0 = clock_type::now();
+        const bool ok = sched.waitPictures(s.get()); // called by the decoder before decode()
+        max_wait_ms = std::max(max_wait_ms, elapsed_ms(t0));
+        if (!ok) {
+            dropped++;
+            continue;
+        }
+        {
+            CedarVScheduler::Slot slot(sched, s.get());
+            this_thread::sleep_for(chrono::milliseconds(1));
+        }
+        max_held = std::max<int>(max_held, ++held);
+        sched.picturesDecoded(s.get(), 1);
+    }
+    stop = true;
+    if (consumer.joinable())
+        consumer.join();
+    const auto st = sched.stats(s.get());
+    sched.close(s);
+    printf("    budget %d, timeout %dms, drop %d, release every %dms: held max %d, waits %llu %.1fms, timeouts %llu, dropped %d, max wait %.1fms\n",
+           budget, timeout_ms, drop, release_ms, max_held.load(), (unsigned long long)st.budget_waits, st.budget_wait_ms, (unsigned long long)st.budget_timeouts, dropped.load(), max_wait_ms);
+    char what[128];
+    if (release_ms >= 0 && release_ms < timeout_ms) {
+        snprintf(what, sizeof(what), "pictures held <= budget %d with waits and no timeout", budget);
+        check(max_held <= budget && st.budget_waits > 0 && st.budget_timeouts == 0 && dropped == 0, what);
+        return;
+    }
+    // never released
+    const uint64_t over = packets - budget; // decodes after the budget is reached
+    if (drop) {
+        snprintf(what, sizeof(what), "drop after %dms timeout, %llu packets dropped", timeout_ms, (unsigned long long)over);
+        check(max_held == budget && dropped == int(over) && st.budget_timeouts == over && max_wait_ms >= timeout_ms*0.9, what);
+    } else {
+        snprintf(what, sizeof(what), "decode anyway after %dms timeout", timeout_ms);
+        check(max_held == packets && dropped == 0 && st.budget_timeouts == over && max_wait_ms >= timeout_ms*0.9, what);
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    vector<int> weights{1, 2, 4};
+    int decode_ms = 2;
+    double seconds = 2;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        if (!strcmp(argv[i], "-w")) {
+            weights.clear();
+            for (const char* p = argv[i + 1]; *p;) {
+                weights.push_back(std::max(atoi(p), 1));
+                p += strcspn(p, ",");
+                p += !!*p;
+            }
+        } else if (!strcmp(argv[i], "-d")) {
+            decode_ms = std::max(atoi(argv[i + 1]), 1);
+        } else if (!strcmp(argv[i], "-s")) {
+            seconds = atof(argv[i + 1]);
+        }
+    }
+    if (weights.empty())
+        weights.push_back(1);
+    test_shares(weights, decode_ms, seconds);
+    test_shares(vector<int>(weights.size(), 1), decode_ms, seconds/2); // equal weights
+    test_idle(decode_ms, seconds);
+    test_budget(3, 200, false, 5, 60);
+    test_budget(2, 50, true, -1, 6);
+    test_budget(2, 50, false, -1, 6);
+    printf("%d failures\n", failures);
+    return failures;
+}
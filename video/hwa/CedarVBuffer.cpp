@@ -1,18 +1,38 @@
 /*
  * Copyright (c) 2018-2020 WangBin <wbsecg1 at gmail.com>
  */
-// env: EGLIMAGE_UMP=0/1/2(0: no ump, 1: input is host output is ump, 2:input is ump). GL_TILE=0/1, SIMD_TILE=0/1
+// env: EGLIMAGE_UMP=0/1/2(0: no ump, 1: input is host output is ump, 2:input is ump). GL_TILE=0/1
+// SIMD_TILE=0/1/name: 0: C reference kernels, 1(default): the fastest kernels detected at runtime, name: kernels by name(C, scalar, sse2, avx2, neon, neon64)
+// HOST_FRAME_BUDGET=MB: max memory of host frames mapped at the same time, default is 64
+// TILE_THREADS=n: threads to convert 32 line tile bands concurrently, 0(default): cpu cores. TILE_MT_MIN=pixels: frames smaller than it are converted in 1 thread, default is 640x480
 // EGLIMAGE_MEM=1 if EGLIMAGE_UMP==0: use host memory as fbdev_pixmap
+// CEDARV_CALIBRATE=1: time untile kernels and threads in background on the 1st map of a resolution class, and cache the fastest in CEDARV_CALIBRATE_FILE(default is ~/.cache/cedarv_calibration).
+//   maps use SIMD_TILE/TILE_THREADS defaults until calibrated. SIMD_TILE, TILE_THREADS/TILE_MT_MIN override calibrated results.
+//   DISP_TILE=1: the disp scaler is used by gl maps if it's faster than the calibrated cpu conversion
+// CEDARV_PREFETCH=n: convert up to n pictures to host frames in background as soon as they are decoded, 0(default): convert when mapped.
+//   CEDARV_PREFETCH_FORMAT=nv12(default)/yuv420p/rgba/bgra/rgb24: should be the host map format without CedarVMapRequest, otherwise maps convert again
 #include "mdk/VideoBuffer.h"
 #include "mdk/VideoFrame.h"
 #include "NativeVideoBufferTemplate.h"
+#include "CedarVBuffer.h"
+#include "tiled_yuv.h"
 #include "video/opengl/GLGlue.h"
 #include "ugl/gl_api.h" // egl_api.h is included if HAVE_EGL_CAPI is defined
 #include "ugl/context.h"
 #include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
 #include <iostream>
+#include <sstream>
+#include <list>
 #include <memory>
 #include <mutex>
+#include <thread>
 extern "C" {
 #include <libcedarv/libcedarv.h> // TODO: remove
 #include <ump/ump.h>
@@ -56,25 +76,90 @@ typedef struct fbdev_pixmap
         unsigned int format; /* extra format information in case rgbal is not enough, especially for YUV formats */
 } fbdev_pixmap;
 
+// recycled memory of buffers returned by getBuffer(), so getBuffer() does not allocate after warm up.
+// shared by the pool and buffer control blocks, because a control block is freed after the buffer releases the pool
+struct buffer_slab_t {
+    struct cleanup_t {
+        class CedarVBufferPool* pool;
+        const cedarv_picture_t* pic;
+        std::function<void()> cleanup;
+    };
+    std::mutex mutex;
+    size_t block_size = 0; // shared_ptr control block + buffer
+    std::vector<void*> blocks; // free
+    std::vector<cleanup_t*> cleanups; // free
+    std::atomic<uint64_t> allocations{0};
+
+    buffer_slab_t() {
+        blocks.reserve(64);
+        cleanups.reserve(64);
+    }
+    ~buffer_slab_t() {
+        for (auto b : blocks)
+            ::operator delete(b);
+        for (auto c : cleanups)
+            delete c;
+    }
+    cleanup_t* getCleanup() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!cleanups.empty()) {
+                auto c = cleanups.back();
+                cleanups.pop_back();
+                return c;
+            }
+        }
+        allocations++;
+        return new cleanup_t();
+    }
+    void putCleanup(cleanup_t* c) {
+        c->cleanup = nullptr;
+        std::lock_guard<std::mutex> lock(mutex);
+        cleanups.push_back(c);
+    }
+};
+
+template<typename T>
+struct slab_allocator {
+    typedef T value_type;
+    std::shared_ptr<buffer_slab_t> slab;
+
+    explicit slab_allocator(std::shared_ptr<buffer_slab_t> s) : slab(std::move(s)) {}
+    template<typename U> slab_allocator(const slab_allocator<U>& a) : slab(a.slab) {}
+    T* allocate(size_t n) {
+        const size_t size = n*sizeof(T);
+        {
+            std::lock_guard<std::mutex> lock(slab->mutex);
+            if (size == slab->block_size && !slab->blocks.empty()) {
+                void* b = slab->blocks.back();
+                slab->blocks.pop_back();
+                return static_cast<T*>(b);
+            }
+        }
+        slab->allocations++;
+        return static_cast<T*>(::operator new(size));
+    }
+    void deallocate(T* p, size_t n) {
+        const size_t size = n*sizeof(T);
+        std::lock_guard<std::mutex> lock(slab->mutex);
+        if (!slab->block_size)
+            slab->block_size = size;
+        if (size == slab->block_size && slab->blocks.size() < slab->blocks.capacity()) {
+            slab->blocks.push_back(p);
+            return;
+        }
+        ::operator delete(p);
+    }
+    template<typename U> bool operator==(const slab_allocator<U>& a) const { return slab == a.slab; }
+    template<typename U> bool operator!=(const slab_allocator<U>& a) const { return slab != a.slab; }
+};
+
 PFNEGLCREATEIMAGEKHRPROC eglCreateImage = nullptr;
 PFNEGLDESTROYIMAGEKHRPROC eglDestroyImage = nullptr;
-// TODO: move tile->linear code to an individual file.
 // TODO: rename to UMPBuffer which can be used for other platforms
 // TODO: no libcedarv.h dependency, use generic struct contains ptrs, and is_ump flag. if picture is ump, no copy
 // TODO: x11 mali egl does not support fbdev_pixmap. try x11 pixmap using xputimage to update pixmap
-static void map32x32_to_yuv_Y(const void* srcY, void* tarY, unsigned int dst_pitch, unsigned int coded_width, unsigned int coded_height);
-static void map32x32_to_yuv_C(const void* srcC, void* tarCb, void* tarCr, unsigned int dst_pitch, unsigned int coded_width, unsigned int coded_height);
-extern "C" {
-void neon_tiled_to_planar(const void *src, void *dst, unsigned int dst_pitch, unsigned int width, unsigned int height);
-void neon_tiled_deinterleave_to_planar(const void *src, void *dst1, void *dst2, unsigned int dst_pitch, unsigned int width, unsigned int height);
-}
-
-typedef void (*map_y_t)(const void* src, void* dst, unsigned int dst_pitch, unsigned int w, unsigned int h);
-map_y_t map_y_ = map32x32_to_yuv_Y;
-typedef void (*map_c_t)(const void* src, void* dst1, void* dst2, unsigned int dst_pitch, unsigned int w, unsigned int h);
-map_c_t map_c_ = map32x32_to_yuv_C;
-
-class CedarVBufferPool final : public NativeVideoBufferPool {
+class CedarVBufferPool final : public NativeVideoBufferPool, public CedarVPoolControl {
 public:
     CedarVBufferPool() {
         ump_open();
@@ -87,15 +172,48 @@ public:
         env = getenv("GL_TILE");
         gl_tile_ = env && atoi(env); // default is true if tile to linear is supported by shader
         env = getenv("SIMD_TILE");
-        if (!env || atoi(env)) {
-            map_y_ = neon_tiled_to_planar;
-            map_c_ = neon_tiled_deinterleave_to_planar;
-        } else {
-            map_y_ = map32x32_to_yuv_Y;
-            map_c_ = map32x32_to_yuv_C;
+        if (env && strcmp(env, "0") == 0)
+            tile_ = tiled_yuv_kernels_find("C");
+        else if (env && strcmp(env, "1") != 0)
+            tile_ = tiled_yuv_kernels_find(env);
+        if (!tile_)
+            tile_ = tiled_yuv_kernels_select();
+        std::clog << "CedarV tile to linear kernels: " << tile_->name << std::endl;
+        simd_env_ = !!getenv("SIMD_TILE");
+        int threads = 0;
+        env = getenv("TILE_THREADS");
+        if (env)
+            threads = atoi(env);
+        if (threads <= 0)
+            threads = std::thread::hardware_concurrency();
+        env = getenv("TILE_MT_MIN");
+        if (env)
+            mt_min_ = atoi(env);
+        threads_env_ = getenv("TILE_THREADS") || getenv("TILE_MT_MIN");
+        if (threads > 1) {
+            workers_.reset(new TiledWorkers(threads));
+            std::clog << "CedarV tile to linear threads: " << threads << ", min frame pixels: " << mt_min_ << std::endl;
+        }
+        env = getenv("HOST_FRAME_BUDGET");
+        if (env)
+            host_budget_ = size_t(atoi(env)) << 20;
+        env = getenv("CEDARV_CALIBRATE");
+        calibrate_ = env && atoi(env);
+        if (calibrate_) {
+            env = getenv("CEDARV_CALIBRATE_FILE");
+            if (env)
+                calib_file_ = env;
+            else if (getenv("HOME"))
+                calib_file_ = std::string(getenv("HOME")) + "/.cache/cedarv_calibration";
+            else
+                calib_file_ = "/tmp/cedarv_calibration";
+            loadCalibration();
         }
+        env = getenv("CEDARV_PREFETCH");
+        if (env && atoi(env) > 0)
+            setPrefetch(atoi(env), getenv("CEDARV_PREFETCH_FORMAT"));
         env = getenv("DISP_TILE");
-        if (env && atoi(env))
+        if (env && atoi(env)) // may be closed by calibration
             disp_fd_ = ::open("/dev/disp", O_RDWR);
         if (disp_fd_ >= 0) {
             unsigned long screen = 0;
@@ -113,16 +231,50 @@ public:
         }
     }
     ~CedarVBufferPool() override {
+        for (auto& t : calib_threads_)
+            t.join();
+        if (prefetch_thread_.joinable()) {
+            {
+                std::lock_guard<std::mutex> lock(prefetch_mutex_);
+                prefetch_stop_ = true;
+            }
+            prefetch_cv_.notify_all();
+            prefetch_thread_.join();
+        }
+        for (auto& f : host_frames_)
+            free(f.data);
         if (disp_fd_ >= 0)
             ::close(disp_fd_);
         ump_close();
     }
 
     NativeVideoBufferRef getBuffer(void* opaque, std::function<void()> cleanup = nullptr) override;
+    uint64_t bufferAllocations() const override { return slab_->allocations; }
+    void stageStats(CedarVStageStats* stats) const override {
+        for (int i = 0; i < CedarVStageCount; ++i)
+            stats[i] = stages_[i].stats(cedarv_stage_name(i));
+    }
+    int buffersInFlight() const override { return in_flight_; }
+    CedarVHostCacheStats hostCacheStats() const override {
+        std::lock_guard<std::mutex> lock(host_mutex_);
+        auto s = host_stats_;
+        s.prefetch_drops = prefetch_drops_;
+        s.direct = direct_maps_;
+        s.bytes = host_bytes_;
+        s.budget = host_budget_;
+        s.frames = 0;
+        for (const auto& f : host_frames_)
+            s.frames += !!f.pic;
+        return s;
+    }
+    void setPrefetch(int depth, const char* format) override;
     bool transfer_begin(cedarv_picture_t* buf, NativeVideoBuffer::GLTextureArray* ma, NativeVideoBuffer::MapParameter *mp);
     void transfer_end();
     bool transfer_to_host(cedarv_picture_t* buf, NativeVideoBuffer::MemoryArray* ma, NativeVideoBuffer::MapParameter *mp);
 private:
+    struct host_key_t;
+    bool transfer_to_host_rgb(cedarv_picture_t* buf, host_key_t& key, const CedarVMapRequest* req, NativeVideoBuffer::MemoryArray* ma, NativeVideoBuffer::MapParameter *mp);
+    bool transfer_to_host_tiled(cedarv_picture_t* buf, int w, int h, NativeVideoBuffer::MemoryArray* ma, NativeVideoBuffer::MapParameter *mp);
     Context* updateContext() {
         Context* c = Context::current();
         if (c == ctx_)
@@ -133,6 +285,27 @@ private:
     }
 
     bool ensureGL(const VideoFormat& fmt, int* w, int* h);
+    void convert(const tiled_plane* planes, int count, int w, int h) {
+        const tiled_yuv_kernels* k = tile_;
+        bool mt = workers_ && w*h >= mt_min_;
+        if (const auto c = calibration(w, h)) {
+            if (!simd_env_)
+                k = c->kernels;
+            if (!threads_env_)
+                mt = workers_ && c->mt;
+        }
+        uint64_t bytes = 0;
+        for (int i = 0; i < count; ++i) {
+            const auto& p = planes[i];
+            const unsigned s = std::max(p.scale, 1u);
+            bytes += uint64_t(p.width)*p.height/(s*s)*(p.rgb ? tiled_rgb_bpp(p.rgb->format) : 1);
+        }
+        CedarVStageTimer t(stages_[CedarVUntile], bytes);
+        if (mt)
+            workers_->convert(k, planes, count);
+        else
+            tiled_convert(k, planes, count);
+    }
 
     struct ctx_res_t {
         int count = 2;
@@ -150,8 +323,108 @@ private:
     bool egl_mem_ = false;
     int gl_ump_ = 1; // better performance. on sun4i 1080p bbb cpu load is about 50%, while host memory cpu is ~95%
     int disp_fd_ = -1;
-    std::mutex hos_mutex_;
-    VideoFrame host_;
+    const tiled_yuv_kernels* tile_ = nullptr; // selected once, never changed
+    int mt_min_ = 640*480;
+    std::unique_ptr<TiledWorkers> workers_;
+    // what a host frame contains
+    struct host_key_t {
+        PixelFormat format;
+        int planes;
+        int x;
+        int y;
+        int width;
+        int height;
+        int color; // rgb only. bit 0: bt709, bit 1: full range
+        int scale;
+        bool operator==(const host_key_t& k) const {
+            return format == k.format && planes == k.planes && x == k.x && y == k.y && width == k.width && height == k.height && color == k.color && scale == k.scale;
+        }
+    };
+    // host frames are checked out by a picture on 1st host map, and returned when the picture is released.
+    // a picture is alive while mapped, so its pointer is a unique key. maps of the same picture and key share the frame, which is converted once
+    struct host_frame_t {
+        const cedarv_picture_t* pic = nullptr;
+        host_key_t key{};
+        bool ready = false; // converted
+        bool prefetched = false; // converted by prefetch and not mapped yet
+        uint8_t* data = nullptr; // cache line aligned
+        size_t size = 0;
+    };
+    // *convert is true if the caller must convert and then call setHostReady(), otherwise the frame is ready
+    host_frame_t* checkoutHost(const cedarv_picture_t* pic, const host_key_t& key, size_t size, bool* convert);
+    void setHostReady(host_frame_t* f) {
+        {
+            std::lock_guard<std::mutex> lock(host_mutex_);
+            f->ready = true;
+        }
+        host_cv_.notify_all();
+    }
+    void releaseHost(const cedarv_picture_t* pic);
+    mutable std::mutex host_mutex_; // guards host frame checkout only, not conversion
+    std::condition_variable host_cv_; // a frame is ready
+    std::list<host_frame_t> host_frames_; // stable addresses
+    size_t host_bytes_ = 0;
+    size_t host_budget_ = 64 << 20;
+    CedarVHostCacheStats host_stats_;
+    // background conversion of decoded pictures. a picture in queue or being converted is alive, releaseHost() removes it or waits
+    void prefetch(cedarv_picture_t* pic);
+    void prefetchRun();
+    std::atomic<int> prefetch_depth_{0}; // max pictures queued or being converted. 0: disabled
+    PixelFormat prefetch_format_ = PixelFormat::NV12;
+    std::thread prefetch_thread_;
+    std::mutex prefetch_mutex_;
+    std::condition_variable prefetch_cv_;
+    std::deque<cedarv_picture_t*> prefetch_queue_;
+    cedarv_picture_t* prefetching_ = nullptr;
+    bool prefetch_stop_ = false;
+    std::atomic<uint64_t> prefetch_drops_{0};
+    std::atomic<uint64_t> direct_maps_{0}; // into CedarVMapRequest.dst
+    std::shared_ptr<buffer_slab_t> slab_ = std::make_shared<buffer_slab_t>();
+    // calibration
+    enum { CalibSD, CalibHD, CalibFHD, CalibUHD, CalibClasses };
+    static int calib_class(int w, int h) {
+        const int pixels = w*h;
+        return pixels <= 720*576 ? CalibSD : (pixels <= 1280*736 ? CalibHD : (pixels <= 1920*1088 ? CalibFHD : CalibUHD));
+    }
+    struct calib_t {
+        bool valid = false;
+        const tiled_yuv_kernels* kernels = nullptr;
+        bool mt = false;
+        double cpu_ns = 0; // fastest nv12 untile
+    };
+    // measured by the gl map thread after the cpu result is published, so not in calib_t
+    struct calib_disp_t {
+        int disp = -1; // -1: not measured, 0/1: use disp scaler in gl path
+        double disp_ns = 0;
+    };
+    // null until the class is calibrated, then lock free
+    const calib_t* calibration(int w, int h) {
+        if (!calibrate_)
+            return nullptr;
+        const int cls = calib_class(w, h);
+        if (const auto c = calib_ready_[cls].load(std::memory_order_acquire))
+            return c;
+        startCalibration(cls, w, h);
+        return nullptr;
+    }
+    void startCalibration(int cls, int w, int h);
+    void calibrate(int cls, int w, int h); // calibration thread
+    void calibrateDisp(cedarv_picture_t* buf, int w, int h);
+    void loadCalibration();
+    void saveCalibration();
+    bool calibrate_ = false;
+    bool simd_env_ = false;
+    bool threads_env_ = false;
+    std::string calib_file_;
+    std::mutex calib_mutex_; // calibration results and file
+    std::condition_variable calib_cv_; // a class is calibrated
+    calib_t calib_[CalibClasses]; // filled before publishing in calib_ready_
+    calib_disp_t calib_disp_[CalibClasses];
+    bool calib_started_[CalibClasses] = {};
+    std::atomic<const calib_t*> calib_ready_[CalibClasses] = {}; // published calib_ entries, not changed after publishing
+    std::vector<std::thread> calib_threads_;
+    CedarVStageCounter stages_[CedarVStageCount]; // pool stages only
+    std::atomic<int> in_flight_{0}; // buffers returned by getBuffer() and not released
 
     Context::Local<ctx_res_t> res = {[](ctx_res_t& r){
         std::clog << "release CedarV-GL interop resources" << std::endl;
@@ -175,7 +448,322 @@ using CedarVBuffer = NativeVideoBufferImpl<cedarv_picture_t*, CedarVBufferPool>;
 
 NativeVideoBufferRef CedarVBufferPool::getBuffer(void* opaque, std::function<void()> cleanup)
 {
-    return std::make_shared<CedarVBuffer>(static_pointer_cast<CedarVBufferPool>(shared_from_this()), static_cast<cedarv_picture_t*>(opaque), cleanup);
+    auto pic = static_cast<cedarv_picture_t*>(opaque);
+    // a capture of 1 pointer is stored in std::function without allocation
+    auto c = slab_->getCleanup();
+    c->pool = this;
+    c->pic = pic;
+    c->cleanup = std::move(cleanup);
+    in_flight_++;
+    if (prefetch_depth_ > 0)
+        prefetch(pic);
+    return std::allocate_shared<CedarVBuffer>(slab_allocator<CedarVBuffer>(slab_), static_pointer_cast<CedarVBufferPool>(shared_from_this()), pic, [c]{
+        auto pool = c->pool;
+        pool->releaseHost(c->pic); // before cleanup because pic may be deleted, and the address can be reused
+        if (c->cleanup)
+            c->cleanup();
+        pool->in_flight_--;
+        pool->slab_->putCleanup(c); // c can be reused by other threads now
+    });
+}
+
+// true in prefetch thread
+static thread_local bool prefetching = false;
+
+void CedarVBufferPool::setPrefetch(int depth, const char* format)
+{
+    std::lock_guard<std::mutex> lock(prefetch_mutex_);
+    prefetch_format_ = PixelFormat::NV12;
+    if (format) {
+        static const struct {
+            const char* name;
+            PixelFormat format;
+        } formats[] = {
+            {"yuv420p", PixelFormat::YUV420P},
+            {"rgba", PixelFormat::RGBA},
+            {"bgra", PixelFormat::BGRA},
+            {"rgb24", PixelFormat::RGB24},
+        };
+        for (const auto& f : formats) {
+            if (strcmp(format, f.name) == 0)
+                prefetch_format_ = f.format;
+        }
+    }
+    prefetch_depth_ = std::max(depth, 0);
+    if (prefetch_depth_ > 0 && !prefetch_thread_.joinable()) {
+        prefetch_thread_ = std::thread(&CedarVBufferPool::prefetchRun, this);
+        std::clog << "CedarV prefetch depth: " << prefetch_depth_ << ", format: " << (format ? format : "nv12") << std::endl;
+    }
+}
+
+void CedarVBufferPool::prefetch(cedarv_picture_t* pic)
+{
+    // maps may run in other threads, so the size is aligned before the picture is shared
+    pic->display_height = FFALIGN(pic->display_height, 8);
+    {
+        std::lock_guard<std::mutex> lock(prefetch_mutex_);
+        if (int(prefetch_queue_.size()) + !!prefetching_ >= prefetch_depth_) {
+            prefetch_drops_++;
+            return;
+        }
+        prefetch_queue_.push_back(pic);
+    }
+    prefetch_cv_.notify_one();
+}
+
+void CedarVBufferPool::prefetchRun()
+{
+    prefetching = true;
+    std::unique_lock<std::mutex> lock(prefetch_mutex_);
+    while (true) {
+        prefetch_cv_.wait(lock, [this]{ return prefetch_stop_ || !prefetch_queue_.empty(); });
+        if (prefetch_stop_)
+            break;
+        prefetching_ = prefetch_queue_.front();
+        prefetch_queue_.pop_front();
+        NativeVideoBuffer::MemoryArray ma{};
+        NativeVideoBuffer::MapParameter mp{};
+        mp.format = prefetch_format_;
+        lock.unlock();
+        transfer_to_host(prefetching_, &ma, &mp); // no CedarVMapRequest in this thread, i.e. the whole picture
+        lock.lock();
+        prefetching_ = nullptr;
+        prefetch_cv_.notify_all();
+    }
+}
+
+CedarVBufferPool::host_frame_t* CedarVBufferPool::checkoutHost(const cedarv_picture_t* pic, const host_key_t& key, size_t size, bool* convert)
+{
+    std::unique_lock<std::mutex> lock(host_mutex_);
+    host_frame_t* free_frame = nullptr;
+    for (auto& f : host_frames_) {
+        if (f.pic == pic && f.key == key) {
+            *convert = false;
+            if (prefetching) // mapped before prefetch
+                return &f;
+            host_stats_.hits++;
+            if (f.prefetched) {
+                f.prefetched = false;
+                host_stats_.prefetch_hits++;
+            }
+            if (!f.ready) { // being converted by another map or prefetch
+                host_stats_.waits++;
+                host_cv_.wait(lock, [&f]{ return f.ready; });
+            }
+            return &f;
+        }
+        if (!f.pic && (!free_frame || f.size == size)) // prefer the same size
+            free_frame = &f;
+    }
+    if (free_frame && free_frame->size < size) { // resolution changed, reallocate lazily
+        host_bytes_ -= free_frame->size;
+        free(free_frame->data);
+        free_frame->data = nullptr;
+        free_frame->size = 0;
+    }
+    if (!free_frame || !free_frame->data) {
+        if (host_bytes_ + size > host_budget_) { // free unused frames of other sizes
+            for (auto it = host_frames_.begin(); it != host_frames_.end() && host_bytes_ + size > host_budget_;) {
+                if (it->pic || &*it == free_frame) {
+                    ++it;
+                    continue;
+                }
+                host_bytes_ -= it->size;
+                free(it->data);
+                it = host_frames_.erase(it);
+            }
+        }
+        if (host_bytes_ + size > host_budget_) {
+            host_stats_.failures++;
+            std::clog << "CedarV host frame budget(" << host_budget_ << ") exceeded. frames in use: " << host_frames_.size() - !!free_frame << std::endl;
+            return nullptr;
+        }
+        void* data = nullptr;
+        if (posix_memalign(&data, 64, size) != 0)
+            return nullptr;
+        if (!free_frame) {
+            host_frames_.emplace_back();
+            free_frame = &host_frames_.back();
+        }
+        free_frame->data = (uint8_t*)data;
+        free_frame->size = size;
+        host_bytes_ += size;
+    }
+    free_frame->pic = pic;
+    free_frame->key = key;
+    free_frame->ready = false;
+    free_frame->prefetched = prefetching;
+    if (prefetching)
+        host_stats_.prefetches++;
+    else
+        host_stats_.misses++;
+    *convert = true;
+    return free_frame;
+}
+
+void CedarVBufferPool::releaseHost(const cedarv_picture_t* pic)
+{
+    if (prefetch_thread_.joinable()) {
+        std::unique_lock<std::mutex> lock(prefetch_mutex_);
+        prefetch_queue_.erase(std::remove(prefetch_queue_.begin(), prefetch_queue_.end(), pic), prefetch_queue_.end());
+        prefetch_cv_.wait(lock, [this, pic]{ return prefetching_ != pic; });
+    }
+    std::lock_guard<std::mutex> lock(host_mutex_);
+    for (auto& f : host_frames_) {
+        if (f.pic == pic)
+            f.pic = nullptr;
+    }
+}
+
+static bool disp_tiled_to_linear(int fd, int width, int height, const void* y, const void* uv, void* dst);
+
+static double now_ns()
+{
+    return (double)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void CedarVBufferPool::startCalibration(int cls, int w, int h)
+{
+    std::lock_guard<std::mutex> lock(calib_mutex_);
+    if (calib_started_[cls])
+        return;
+    calib_started_[cls] = true;
+    calib_threads_.emplace_back(&CedarVBufferPool::calibrate, this, cls, w, h);
+}
+
+void CedarVBufferPool::calibrate(int cls, int w, int h)
+{
+    // synthetic nv12 frame of the same size. best of 3 runs of every kernels, single and multiple threads.
+    // maps converting at the same time make the results slower, the fastest is still likely the same.
+    // own workers, workers_ runs in the calling thread only while a map is converting
+    w = FFALIGN(w, 2);
+    h = FFALIGN(h, 2);
+    const int tiles = (w + 31)/32;
+    std::vector<uint8_t> y(size_t(tiles)*((h + 31)/32)*1024), uv(size_t(tiles)*((h/2 + 31)/32)*1024);
+    unsigned seed = 1;
+    for (auto& b : y)
+        b = uint8_t((seed = seed*1103515245 + 12345) >> 16);
+    for (auto& b : uv)
+        b = uint8_t((seed = seed*1103515245 + 12345) >> 16);
+    const int pitch = FFALIGN(w, 64);
+    std::vector<uint8_t> dst(size_t(pitch)*(h + h/2) + 64);
+    const tiled_plane planes[] = {
+        {y.data(), {dst.data(), nullptr}, (unsigned)pitch, (unsigned)w, (unsigned)h, false, 0, 0, 0, nullptr, nullptr, 0, false},
+        {uv.data(), {dst.data() + size_t(pitch)*h, nullptr}, (unsigned)pitch, (unsigned)w, (unsigned)h/2, false, 0, 0, 0, nullptr, nullptr, 0, true},
+    };
+    int nb = 0;
+    const auto kernels = tiled_yuv_kernels_supported(&nb);
+    std::unique_ptr<TiledWorkers> workers;
+    if (workers_)
+        workers.reset(new TiledWorkers(workers_->threads()));
+    calib_t c;
+    for (int i = 0; i < nb; ++i) {
+        for (int mt = 0; mt <= !!workers; ++mt) {
+            double best = 0;
+            for (int run = 0; run < 4; ++run) { // 1st run warms up caches and threads
+                const double t0 = now_ns();
+                if (mt)
+                    workers->convert(&kernels[i], planes, 2);
+                else
+                    tiled_convert(&kernels[i], planes, 2);
+                const double t = now_ns() - t0;
+                if (run > 0 && (best == 0 || t < best))
+                    best = t;
+            }
+            if (c.cpu_ns == 0 || best < c.cpu_ns) {
+                c.cpu_ns = best;
+                c.kernels = &kernels[i];
+                c.mt = !!mt;
+            }
+        }
+    }
+    c.valid = true;
+    std::clog << "CedarV calibrated " << w << "x" << h << ": " << c.kernels->name << (c.mt ? " multithreaded " : " ") << c.cpu_ns/1000 << "us" << std::endl;
+    std::lock_guard<std::mutex> lock(calib_mutex_);
+    calib_[cls] = c;
+    saveCalibration();
+    calib_ready_[cls].store(&calib_[cls], std::memory_order_release);
+    calib_cv_.notify_all();
+}
+
+void CedarVBufferPool::calibrateDisp(cedarv_picture_t* buf, int w, int h)
+{
+    const int cls = calib_class(w, h);
+    auto c = calibration(w, h);
+    std::unique_lock<std::mutex> lock(calib_mutex_);
+    if (!c) { // gl resources depend on disp, wait for cpu result
+        calib_cv_.wait(lock, [&]{ return !!calib_ready_[cls].load(); });
+        c = calib_ready_[cls].load();
+    }
+    calib_disp_t& cd = calib_disp_[cls];
+    if (cd.disp < 0) {
+        ump_handle ump = ump_ref_drv_allocate(size_t(w)*h*4, ump_alloc_constraints(UMP_REF_DRV_CONSTRAINT_PHYSICALLY_LINEAR|UMP_REF_DRV_CONSTRAINT_USE_CACHE));
+        if (ump) {
+            void* dst = ump_mapped_pointer_get(ump);
+            double best = 0;
+            for (int run = 0; run < 3; ++run) {
+                const double t0 = now_ns();
+                if (!disp_tiled_to_linear(disp_fd_, w, h, buf->y, buf->u, dst)) {
+                    best = 0;
+                    break;
+                }
+                const double t = now_ns() - t0;
+                if (best == 0 || t < best)
+                    best = t;
+            }
+            ump_mapped_pointer_release(ump);
+            ump_reference_release(ump);
+            cd.disp_ns = best;
+            cd.disp = best > 0 && best < c->cpu_ns;
+            std::clog << "CedarV calibrated disp scaler " << w << "x" << h << ": " << best/1000 << "us, " << (cd.disp ? "used" : "not used") << std::endl;
+            saveCalibration();
+        }
+    }
+    if (cd.disp <= 0) {
+        ::close(disp_fd_);
+        disp_fd_ = -1;
+    }
+}
+
+// line: class kernels mt cpu_ns disp disp_ns
+void CedarVBufferPool::loadCalibration()
+{
+    std::ifstream f(calib_file_);
+    std::string line;
+    while (std::getline(f, line)) {
+        std::istringstream ss(line);
+        int cls = -1, mt = 0, disp = -1;
+        std::string name;
+        double cpu_ns = 0, disp_ns = 0;
+        if (!(ss >> cls >> name >> mt >> cpu_ns >> disp >> disp_ns) || cls < 0 || cls >= CalibClasses)
+            continue;
+        const auto k = tiled_yuv_kernels_find(name.data());
+        if (!k) // cpu changed?
+            continue;
+        calib_t& c = calib_[cls];
+        c.valid = true;
+        c.kernels = k;
+        c.mt = !!mt;
+        c.cpu_ns = cpu_ns;
+        calib_disp_[cls].disp = disp;
+        calib_disp_[cls].disp_ns = disp_ns;
+        calib_started_[cls] = true;
+        calib_ready_[cls].store(&c, std::memory_order_release);
+    }
+}
+
+void CedarVBufferPool::saveCalibration()
+{
+    std::ofstream f(calib_file_, std::ios::trunc);
+    if (!f) {
+        std::clog << "failed to write CedarV calibration file " << calib_file_ << std::endl;
+        return;
+    }
+    for (int i = 0; i < CalibClasses; ++i) {
+        const calib_t& c = calib_[i];
+        if (c.valid)
+            f << i << " " << c.kernels->name << " " << c.mt << " " << c.cpu_ns << " " << calib_disp_[i].disp << " " << calib_disp_[i].disp_ns << "\n";
+    }
 }
 
 static bool disp_tiled_to_linear(int fd, int width, int height, const void* y, const void* uv, void* dst)
@@ -305,8 +893,11 @@ bool CedarVBufferPool::transfer_begin(cedarv_picture_t* buf, NativeVideoBuffer::
     if (!ctx_res_) {
         ctx_res_ = &res.get(ctx_);
     }
+    if (!ctx_res_->tex[0] && disp_fd_ >= 0 && calibrate_ && !gl_tile_) // gl resources depend on disp, so decide before creating them
+        calibrateDisp(buf, FFALIGN(buf->display_width, 16), FFALIGN(FFALIGN(buf->display_height, 8), 2));
     const VideoFormat fmt = disp_fd_ >= 0 ? PixelFormat::RGBA : PixelFormat::NV12T32x32;
-    buf->display_height = FFALIGN(buf->display_height, 8);
+    if (buf->display_height % 8) // aligned by prefetch
+        buf->display_height = FFALIGN(buf->display_height, 8);
     mp->width[0] = FFALIGN(buf->display_width, 16);
     mp->height[0] = FFALIGN(buf->display_height, 2); // already aligned to 8!
     mp->width[1] = fmt.width(mp->width[0], 1);
@@ -321,7 +912,11 @@ bool CedarVBufferPool::transfer_begin(cedarv_picture_t* buf, NativeVideoBuffer::
     const void* bits[] = {buf->y, buf->u};
     if (disp_fd_ >= 0) {
         void* dst = (void*)ump_mapped_pointer_get(ctx_res_->ump[0]);
-        const bool ret = disp_tiled_to_linear(disp_fd_, mp->width[0], mp->height[0], bits[0], bits[1], dst);
+        bool ret = false;
+        {
+            CedarVStageTimer t(stages_[CedarVDispScaler], uint64_t(mp->width[0])*mp->height[0]*4);
+            ret = disp_tiled_to_linear(disp_fd_, mp->width[0], mp->height[0], bits[0], bits[1], dst);
+        }
         ump_mapped_pointer_release(ctx_res_->ump[0]);
         if (ret) {
             ma->id[0] = ctx_res_->tex[0];
@@ -334,15 +929,21 @@ bool CedarVBufferPool::transfer_begin(cedarv_picture_t* buf, NativeVideoBuffer::
         }
     }
 
+    if (gl_ump_ == 1 && !gl_tile_) { // all planes at once, so bands of different planes can be converted concurrently
+        tiled_plane planes[2]{};
+        for (int i = 0; i < ctx_res_->count; ++i)
+            planes[i] = {bits[i], {(void*)ump_mapped_pointer_get(ctx_res_->ump[i]), nullptr}, (unsigned)mp->stride[i], (unsigned)mp->width[0] /* because use map_y*/, (unsigned)mp->height[i], false, 0, 0, 0, nullptr, nullptr, 0, i > 0};
+        convert(planes, ctx_res_->count, mp->width[0], mp->height[0]);
+        for (int i = 0; i < ctx_res_->count; ++i)
+            ump_mapped_pointer_release(ctx_res_->ump[i]);
+    }
     for (int i = 0; i < ctx_res_->count; ++i) {
         if (gl_ump_ == 1) {
             //ump_switch_hw_usage(ctx_res_->ump[i], UMP_USED_BY_CPU);
             //ump_lock(ctx_res_->ump[i], UMP_READ_WRITE);
             if (gl_tile_) {
+                CedarVStageTimer t(stages_[CedarVUmpWrite], fmt.bytesForPlane(mp->width[0], mp->height[0], i));
                 ump_write(ctx_res_->ump[i], 0, bits[i], fmt.bytesForPlane(mp->width[0], mp->height[0], i));
-            } else {
-                map_y_(bits[i], (void*)ump_mapped_pointer_get(ctx_res_->ump[i]), mp->stride[i], mp->width[0] /* because use map_y_*/, mp->height[i]);
-                ump_mapped_pointer_release(ctx_res_->ump[i]);
             }
 //            ump_unlock(ctx_res_->ump[i]);
             //ump_switch_hw_usage(ctx_res_->ump[i], UMP_USED_BY_MALI);
@@ -386,108 +987,198 @@ void CedarVBufferPool::transfer_end()
         ump = nullptr;
     }
 }
-// source data is colum major. every block is 32x32
-void map32x32_to_yuv_Y(const void* srcY, void* tarY, unsigned int dst_pitch, unsigned int coded_width, unsigned int coded_height)
+static PixelFormat host_format(const VideoFormat& requested)
 {
-    unsigned long offset;
-    unsigned char *ptr = (unsigned char *)srcY;
-    const unsigned int mb_width = (coded_width+15) >> 4;
-    const unsigned int mb_height = (coded_height+15) >> 4;
-    const unsigned int twomb_line = (mb_height+1) >> 1;
-    const unsigned int recon_width = (mb_width+1) & 0xfffffffe;
-
-    for (unsigned int i = 0; i < twomb_line; i++) {
-        const unsigned int M = 32*i;
-        for (unsigned int j = 0; j < recon_width; j+=2) {
-            const unsigned int n = j*16;
-            offset = M*dst_pitch + n;
-            for (unsigned int l = 0; l < 32; l++) {
-                if (M+l < coded_height) {
-                    if (n+16 < coded_width) {
-                        //1st & 2nd mb
-                        memcpy((unsigned char *)tarY+offset, ptr, 32);
-                    } else if (n<coded_width) {
-                        // 1st mb
-                        memcpy((unsigned char *)tarY+offset, ptr, 16);
-                    }
-                    offset += dst_pitch;
-                }
-                ptr += 32;
-            }
-        }
+    for (auto f : {PixelFormat::YUV420P, PixelFormat::RGBA, PixelFormat::BGRA, PixelFormat::RGB24, PixelFormat::NV12T32x32}) {
+        if (requested == f)
+            return f;
     }
+    return PixelFormat::NV12;
 }
 
-void map32x32_to_yuv_C(const void* srcC, void* tarCb, void* tarCr, unsigned int dst_pitch, unsigned int coded_width, unsigned int coded_height)
+bool CedarVBufferPool::transfer_to_host(cedarv_picture_t* buf, NativeVideoBuffer::MemoryArray* ma, NativeVideoBuffer::MapParameter *mp)
 {
-    coded_width /= 2; // libvdpau-sunxi compatible
-    unsigned char line[32];
-    unsigned long offset;
-    unsigned char *ptr = (unsigned char *)srcC;
-    const unsigned int mb_width = (coded_width+7) >> 3;
-    const unsigned int mb_height = (coded_height+7) >> 3;
-    const unsigned int fourmb_line = (mb_height+3) >> 2;
-    const unsigned int recon_width = (mb_width+1) & 0xfffffffe;
-
-    for (unsigned int i = 0; i < fourmb_line; i++) {
-        const int M = i*32;
-        for (unsigned int j = 0; j < recon_width; j+=2) {
-            const unsigned int n = j*8;
-            offset = M*dst_pitch + n;
-            for (unsigned int l = 0; l < 32; l++) {
-                if (M+l < coded_height) {
-                    if (n+8 < coded_width) {
-                        // 1st & 2nd mb
-                        memcpy(line, ptr, 32);
-                        //unsigned char *line = ptr;
-                        for (int k = 0; k < 16; k++) {
-                            *((unsigned char *)tarCb + offset + k) = line[2*k];
-                            *((unsigned char *)tarCr + offset + k) = line[2*k+1];
-                        }
-                    } else if (n < coded_width) {
-                        // 1st mb
-                        memcpy(line, ptr, 16);
-                        //unsigned char *line = ptr;
-                        for (int k = 0; k < 8; k++) {
-                            *((unsigned char *)tarCb + offset + k) = line[2*k];
-                            *((unsigned char *)tarCr + offset + k) = line[2*k+1];
-                        }
-                    }
-                    offset += dst_pitch;
-                }
-                ptr += 32;
-            }
+    if (buf->display_height % 8) // aligned by prefetch
+        buf->display_height = FFALIGN(buf->display_height, 8);
+    const int w = FFALIGN(buf->display_width, 16);
+    const int h = FFALIGN(buf->display_height, 2); // already aligned to 8!
+    // mp->format is the requested format. yuv420p is deinterleaved while untiling, rgb is converted while untiling, nv12 otherwise
+    const PixelFormat format = gl_tile_ && mp->format != PixelFormat::NV12T32x32 ? PixelFormat::NV12 : host_format(mp->format);
+    if (format == PixelFormat::NV12T32x32) // zero copy
+        return transfer_to_host_tiled(buf, w, h, ma, mp);
+    const bool planar = format == PixelFormat::YUV420P;
+    host_key_t key{format, CedarVMapRequest::AllPlanes, 0, 0, w, h, 0, 1};
+    const auto req = CedarVMapScope::current();
+    if (req && !gl_tile_) {
+        key.planes = req->planes & CedarVMapRequest::AllPlanes;
+        key.x = std::min(std::max(req->x, 0), w - 2) & ~1;
+        key.y = std::min(std::max(req->y, 0), h - 2) & ~1;
+        key.width = FFALIGN(std::min(req->width > 0 ? req->width : w, w - key.x), 2);
+        key.height = FFALIGN(std::min(req->height > 0 ? req->height : h, h - key.y), 2);
+    }
+    if (format == PixelFormat::RGBA || format == PixelFormat::BGRA || format == PixelFormat::RGB24)
+        return transfer_to_host_rgb(buf, key, req, ma, mp);
+    if (req && !gl_tile_ && req->scale > 1) {
+        key.scale = req->scale >= 8 ? 8 : (req->scale >= 4 ? 4 : 2);
+        // a chroma block is 2*scale bytes. crop instead of reading outside the picture
+        while (key.scale > 1 && (key.width < 2*key.scale || key.height < 2*key.scale))
+            key.scale /= 2;
+        key.width -= key.width % (2*key.scale);
+        key.height -= key.height % (2*key.scale);
+    }
+    const int out_w = key.width/key.scale;
+    const int out_h = key.height/key.scale;
+    int dst_y_stride = gl_tile_ ? w : FFALIGN(out_w, 64);
+    int dst_c_stride = planar ? FFALIGN(out_w/2, 64) : dst_y_stride; // nv12 uv plane is the same as luma
+    // caller's memory. host data of GL_TILE is tiled
+    const bool user_dst = req && !gl_tile_ && (req->dst[0] || req->dst[1]);
+    if (user_dst) {
+        const bool luma = key.planes & CedarVMapRequest::Luma;
+        const bool chroma = key.planes & CedarVMapRequest::Chroma;
+        if ((luma && (!req->dst[0] || req->dst_stride[0] < out_w))
+            || (chroma && (!req->dst[1] || req->dst_stride[1] < (planar ? out_w/2 : out_w)))
+            || (chroma && planar && (!req->dst[2] || req->dst_stride[2] != req->dst_stride[1]))) { // u and v are deinterleaved with 1 pitch
+            std::clog << "CedarV: invalid map destination for " << out_w << "x" << out_h << std::endl;
+            return false;
         }
+        dst_y_stride = req->dst_stride[0];
+        dst_c_stride = req->dst_stride[1];
+    }
+    const VideoFormat fmt = key.format;
+    mp->format = fmt;
+    for (int i = 0; i < fmt.planeCount(); ++i) {
+        mp->width[i] = fmt.width(out_w, i);
+        mp->height[i] = fmt.height(out_h, i);
+        mp->stride[i] = i ? dst_c_stride : dst_y_stride;
+    }
+    const size_t c_size = FFALIGN(size_t(dst_c_stride)*out_h/2, 64);
+    const size_t plane_size[] = {
+        (key.planes & CedarVMapRequest::Luma) ? FFALIGN(size_t(dst_y_stride)*out_h, 64) : 0,
+        (key.planes & CedarVMapRequest::Chroma) ? c_size*(planar ? 2 : 1) : 0,
+    };
+    bool convert_host = true;
+    host_frame_t* host = nullptr;
+    uint8_t* host_planes[3]{};
+    if (user_dst) {
+        host_planes[0] = plane_size[0] ? req->dst[0] : nullptr;
+        host_planes[1] = plane_size[1] ? req->dst[1] : nullptr;
+        host_planes[2] = plane_size[1] && planar ? req->dst[2] : nullptr;
+        direct_maps_++;
+    } else {
+        host = checkoutHost(buf, key, plane_size[0] + plane_size[1], &convert_host);
+        if (!host)
+            return false;
+        host_planes[0] = plane_size[0] ? host->data : nullptr;
+        host_planes[1] = plane_size[1] ? host->data + plane_size[0] : nullptr;
+        host_planes[2] = plane_size[1] && planar ? host->data + plane_size[0] + c_size : nullptr;
     }
+    for (int i = 0; i < fmt.planeCount(); ++i)
+        ma->data[i] = host_planes[i];
+    if (!convert_host) // converted by a previous or concurrent map
+        return true;
+    if (gl_tile_) {
+        if (host_planes[0])
+            memcpy(host_planes[0], buf->y, fmt.bytesForPlane(w, h, 0));
+        if (host_planes[1])
+            memcpy(host_planes[1], buf->u, fmt.bytesForPlane(w, h, 1));
+        setHostReady(host);
+        return true;
+    }
+    // tiled uv plane is converted as a plane of 2 bytes per pixel, so width and x are in bytes, the same as luma
+    tiled_plane planes[2]{};
+    int nb_planes = 0;
+    if (host_planes[0])
+        planes[nb_planes++] = {buf->y, {host_planes[0], nullptr}, (unsigned)dst_y_stride, (unsigned)key.width, (unsigned)key.height, false, (unsigned)key.x, (unsigned)key.y, (unsigned)w, nullptr, nullptr, (unsigned)key.scale, false};
+    if (host_planes[1])
+        planes[nb_planes++] = {buf->u, {host_planes[1], host_planes[2]}, (unsigned)dst_c_stride, (unsigned)key.width, (unsigned)key.height/2, planar, (unsigned)key.x, (unsigned)key.y/2, (unsigned)w, nullptr, nullptr, (unsigned)key.scale, true};
+    convert(planes, nb_planes, key.width, key.height);
+    if (host)
+        setHostReady(host);
+    return true;
 }
 
-bool CedarVBufferPool::transfer_to_host(cedarv_picture_t* buf, NativeVideoBuffer::MemoryArray* ma, NativeVideoBuffer::MapParameter *mp)
+bool CedarVBufferPool::transfer_to_host_tiled(cedarv_picture_t* buf, int w, int h, NativeVideoBuffer::MemoryArray* ma, NativeVideoBuffer::MapParameter *mp)
 {
-    if (ma->data[0]) // can be reused
-        return true;
-    buf->display_height = FFALIGN(buf->display_height, 8);
-    const int w = FFALIGN(buf->display_width, 16);
-    const int h = FFALIGN(buf->display_height, 2); // already aligned to 8!
-    const int dst_y_stride = w;
-    //const int dst_c_stride = FFALIGN(buf->display_width/2, 16);
-    mp->stride[0] = dst_y_stride;
-    mp->stride[1] = dst_y_stride; // uv plane
-    std::lock_guard<std::mutex> lock(hos_mutex_);
-    const VideoFormat fmt = PixelFormat::NV12;
+    const CedarVTileLayout layout(w, h);
+    const auto req = CedarVMapScope::current();
+    const int planes = req ? req->planes : CedarVMapRequest::AllPlanes;
+    if (req && req->tile_layout)
+        *req->tile_layout = layout;
+    const VideoFormat fmt = PixelFormat::NV12T32x32;
     mp->format = fmt;
-    if (host_.width() != w || host_.height() != h)
-        host_ = VideoFrame(w, h, fmt, mp->stride);
-    const void* bits[] = {buf->y, buf->u};
     for (int i = 0; i < fmt.planeCount(); ++i) {
-        ma->data[i] = host_.buffer(i)->data();
-        if (gl_tile_)
-            memcpy(ma->data[i], bits[i], fmt.bytesForPlane(w, h, i));
-        else
-            map_y_(bits[i], ma->data[i], mp->stride[i], fmt.bytesPerLine(w, i)/*because use map_y_*/, fmt.height(h, i));
+        mp->width[i] = fmt.width(w, i);
+        mp->height[i] = fmt.height(h, i);
+        mp->stride[i] = layout.padded_width;
     }
+    ma->data[0] = (planes & CedarVMapRequest::Luma) ? buf->y : nullptr;
+    ma->data[1] = (planes & CedarVMapRequest::Chroma) ? buf->u : nullptr;
     return true;
 }
 
+bool CedarVBufferPool::transfer_to_host_rgb(cedarv_picture_t* buf, host_key_t& key, const CedarVMapRequest* req, NativeVideoBuffer::MemoryArray* ma, NativeVideoBuffer::MapParameter *mp)
+{
+    const bool bt709 = req && req->matrix != CedarVMapRequest::MatrixAuto ? req->matrix == CedarVMapRequest::BT709 : buf->display_height >= 720;
+    const bool full_range = req && req->full_range;
+    key.planes = CedarVMapRequest::AllPlanes;
+    key.color = (bt709 ? 1 : 0) | (full_range ? 2 : 0);
+    tiled_rgb_params params;
+    tiled_rgb_params_init(&params, key.format == PixelFormat::RGBA ? TILED_RGBA : (key.format == PixelFormat::BGRA ? TILED_BGRA : TILED_RGB24), bt709, full_range);
+    int stride = FFALIGN(key.width*tiled_rgb_bpp(params.format), 64);
+    const bool user_dst = req && !gl_tile_ && req->dst[0];
+    if (user_dst) {
+        if (req->dst_stride[0] < key.width*tiled_rgb_bpp(params.format)) {
+            std::clog << "CedarV: invalid map destination for " << key.width << "x" << key.height << std::endl;
+            return false;
+        }
+        stride = req->dst_stride[0];
+    }
+    mp->format = key.format;
+    mp->width[0] = key.width;
+    mp->height[0] = key.height;
+    mp->stride[0] = stride;
+    bool convert_host = true;
+    host_frame_t* host = nullptr;
+    uint8_t* data = nullptr;
+    if (user_dst) {
+        data = req->dst[0];
+        direct_maps_++;
+    } else {
+        host = checkoutHost(buf, key, size_t(stride)*key.height, &convert_host);
+        if (!host)
+            return false;
+        data = host->data;
+    }
+    ma->data[0] = data;
+    if (!convert_host)
+        return true;
+    const int w = FFALIGN(buf->display_width, 16);
+    const tiled_plane plane{buf->y, {data, nullptr}, (unsigned)stride, (unsigned)key.width, (unsigned)key.height, false, (unsigned)key.x, (unsigned)key.y, (unsigned)w, buf->u, &params, 0, false};
+    convert(&plane, 1, key.width, key.height);
+    if (host)
+        setHostReady(host);
+    return true;
+}
+
+// request can be null
+static thread_local const CedarVMapRequest* map_request = nullptr;
+
+CedarVMapScope::CedarVMapScope(const CedarVMapRequest& request)
+    : prev_(map_request)
+{
+    map_request = &request;
+}
+
+CedarVMapScope::~CedarVMapScope()
+{
+    map_request = prev_;
+}
+
+const CedarVMapRequest* CedarVMapScope::current()
+{
+    return map_request;
+}
+
 void register_native_buffer_pool_cedarv() {
     NativeVideoBufferPool::registerOnce("CedarV", []{
         return std::make_shared<CedarVBufferPool>();
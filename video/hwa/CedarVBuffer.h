@@ -0,0 +1,123 @@
+/*
+ * Copyright (c) 2018-2020 WangBin <wbsecg1 at gmail.com>
+ */
+// host memory map options of CedarV buffers("CedarV" NativeVideoBufferPool)
+// output format of a host map is MapParameter.format if supported(NV12, YUV420P, RGBA, BGRA, RGB24, NV12T32x32), otherwise NV12
+// NV12T32x32 is not converted: plane data are pointers to the decoded picture, valid while the buffer is alive, MapParameter.stride is CedarVTileLayout.padded_width
+#pragma once
+#include "mdk/global.h"
+#include "CedarVStats.h"
+#include <cstdint>
+
+MDK_NS_BEGIN
+// sunxi 32x32 tiled(MB32) nv12 layout. interleaved uv plane has the same layout as luma with half lines
+struct CedarVTileLayout {
+    enum Order {
+        RowMajor, // tile rows from top to bottom, tiles in a row from left to right, every tile is tile_height lines of tile_width bytes
+    };
+    int tile_width = 32; // bytes
+    int tile_height = 32;
+    Order order = RowMajor;
+    int width = 0; // picture size in luma pixels
+    int height = 0;
+    int padded_width = 0; // bytes of a line in a tile row, i.e. tiles per row x tile_width. the same for luma and uv
+    int padded_height[2] = {}; // luma and uv lines including padding of the last tile row
+    size_t plane_size[2] = {};
+
+    CedarVTileLayout() = default;
+    CedarVTileLayout(int w, int h) : width(w), height(h) {
+        padded_width = (w + tile_width - 1)/tile_width*tile_width;
+        padded_height[0] = (h + tile_height - 1)/tile_height*tile_height;
+        padded_height[1] = (h/2 + tile_height - 1)/tile_height*tile_height;
+        plane_size[0] = size_t(padded_width)*padded_height[0];
+        plane_size[1] = size_t(padded_width)*padded_height[1];
+    }
+    // byte offset of pixel(x, y) in a plane. x is in bytes
+    size_t offset(int x, int y) const {
+        return size_t(y/tile_height)*padded_width*tile_height + size_t(x/tile_width)*tile_width*tile_height + (y%tile_height)*tile_width + x%tile_width;
+    }
+};
+
+struct CedarVMapRequest {
+    enum Plane {
+        Luma = 1,
+        Chroma = 1 << 1,
+        AllPlanes = Luma | Chroma,
+    };
+    int planes = AllPlanes; // unmapped plane data is null
+    // region in luma pixels. aligned to 2, and clipped to the picture. width/height <= 0: to the right/bottom
+    int x = 0;
+    int y = 0;
+    int width = 0;
+    int height = 0;
+    // 2, 4 or 8: downscale the region by averaging scale x scale pixels, yuv output only. region is cropped to a multiple of 2*scale
+    int scale = 1;
+    // rgb output only. planes are ignored
+    enum ColorMatrix {
+        MatrixAuto, // BT709 if picture height >= 720
+        BT601,
+        BT709,
+    };
+    ColorMatrix matrix = MatrixAuto;
+    bool full_range = false;
+    // output. filled if NV12T32x32 is mapped. region and scale are ignored for NV12T32x32
+    CedarVTileLayout* tile_layout = nullptr;
+    // caller's memory to convert into if dst[0] or dst[1] is not null, e.g. an encoder input frame, shared memory or a mapped file. not NV12T32x32 or GL_TILE.
+    // plane i of output format: y, uv(nv12), y, u, v(yuv420p) or rgb. any alignment. dst_stride[i] >= bytes of an output line, yuv420p u and v strides must be equal.
+    // mapped data are dst, valid until the caller frees it. no host frame is cached or shared, map fails if a mapped plane is invalid
+    uint8_t* dst[3] = {};
+    int dst_stride[3] = {};
+};
+
+// host map results shared by maps of the same picture and output
+struct CedarVHostCacheStats {
+    uint64_t hits = 0; // maps sharing a converted frame
+    uint64_t waits = 0; // hits waiting for a concurrent conversion
+    uint64_t misses = 0; // conversions
+    uint64_t failures = 0; // budget exceeded
+    uint64_t prefetches = 0; // conversions by prefetch, not counted in misses
+    uint64_t prefetch_hits = 0; // prefetched frames mapped
+    uint64_t prefetch_drops = 0; // pictures not prefetched because of prefetch depth
+    uint64_t direct = 0; // maps converted into CedarVMapRequest.dst
+    size_t bytes = 0; // allocated, including frames of released pictures kept for reuse
+    size_t budget = 0; // HOST_FRAME_BUDGET
+    int frames = 0; // frames of alive pictures
+};
+
+// CedarV NativeVideoBufferPool specific api, e.g. dynamic_cast<CedarVPoolControl*>(NativeVideoBufferPool::create("CedarV").get())
+class CedarVPoolControl {
+public:
+    virtual ~CedarVPoolControl() = default;
+    // heap allocations of getBuffer(). does not increase after warm up
+    virtual uint64_t bufferAllocations() const = 0;
+    // CedarVStageCount stats of untile, ump_write and disp_scaler stages. other stages are empty. thread safe
+    virtual void stageStats(CedarVStageStats* stats) const = 0;
+    virtual int buffersInFlight() const = 0;
+    virtual CedarVHostCacheStats hostCacheStats() const = 0;
+    // convert up to depth pictures to host frames of format(nv12, yuv420p, rgba, bgra or rgb24. null is nv12) in background when decoded.
+    // host maps of the whole picture in the same format wait for the conversion instead of converting again. depth 0 disables prefetch
+    virtual void setPrefetch(int depth, const char* format) = 0;
+};
+
+/*!
+  host memory maps of CedarV buffers in the current thread use the request while the scope is alive, e.g.
+  \code
+    CedarVMapRequest r;
+    r.planes = CedarVMapRequest::Luma;
+    CedarVMapScope scope(r);
+    // map frame buffer to host memory
+  \endcode
+  scopes can be nested, request must be alive in scope
+ */
+class CedarVMapScope {
+public:
+    explicit CedarVMapScope(const CedarVMapRequest& request);
+    ~CedarVMapScope();
+    static const CedarVMapRequest* current(); // null if not in scope
+private:
+    CedarVMapScope(const CedarVMapScope&) = delete;
+    CedarVMapScope& operator=(const CedarVMapScope&) = delete;
+
+    const CedarVMapRequest* prev_;
+};
+MDK_NS_END
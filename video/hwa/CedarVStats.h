@@ -0,0 +1,115 @@
+/*
+ * Copyright (c) 2018-2020 WangBin <wbsecg1 at gmail.com>
+ */
+// lock free per stage counters and latency histograms of CedarV decoding and mapping
+#pragma once
+#include "mdk/global.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+
+MDK_NS_BEGIN
+enum CedarVStage {
+    // decoder
+    CedarVRequestWrite,
+    CedarVStreamCopy, // packet to bitstream ring, bytes are copied bytes
+    CedarVUpdateData,
+    CedarVDecode,
+    CedarVDisplayRequest,
+    // pool
+    CedarVUntile, // transfer_to_host() and transfer_begin() tile to linear conversion, bytes are output bytes
+    CedarVUmpWrite,
+    CedarVDispScaler,
+    CedarVStageCount
+};
+
+inline const char* cedarv_stage_name(int stage)
+{
+    static const char* names[] = {"request_write", "stream_copy", "update_data", "decode", "display_request", "untile", "ump_write", "disp_scaler"};
+    return stage >= 0 && stage < CedarVStageCount ? names[stage] : "?";
+}
+
+struct CedarVStageStats {
+    const char* name = nullptr;
+    uint64_t count = 0;
+    uint64_t bytes = 0;
+    uint64_t total_ns = 0;
+    // latencies are upper bounds of power of 2 buckets, except max
+    uint64_t p50_ns = 0;
+    uint64_t p99_ns = 0;
+    uint64_t max_ns = 0;
+};
+
+class CedarVStageCounter {
+public:
+    void add(uint64_t ns, uint64_t bytes = 0) {
+        count_.fetch_add(1, std::memory_order_relaxed);
+        if (bytes)
+            bytes_.fetch_add(bytes, std::memory_order_relaxed);
+        total_ns_.fetch_add(ns, std::memory_order_relaxed);
+        uint64_t m = max_ns_.load(std::memory_order_relaxed);
+        while (ns > m && !max_ns_.compare_exchange_weak(m, ns, std::memory_order_relaxed)) {}
+        int b = 0;
+        while (b < Buckets - 1 && (uint64_t(1) << (b + 1)) <= ns)
+            ++b;
+        hist_[b].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    CedarVStageStats stats(const char* name) const {
+        CedarVStageStats s;
+        s.name = name;
+        s.count = count_.load(std::memory_order_relaxed);
+        s.bytes = bytes_.load(std::memory_order_relaxed);
+        s.total_ns = total_ns_.load(std::memory_order_relaxed);
+        s.max_ns = max_ns_.load(std::memory_order_relaxed);
+        uint64_t h[Buckets], n = 0;
+        for (int i = 0; i < Buckets; ++i)
+            n += (h[i] = hist_[i].load(std::memory_order_relaxed));
+        uint64_t acc = 0;
+        for (int i = 0; i < Buckets && n; ++i) {
+            acc += h[i];
+            const uint64_t upper = std::min(uint64_t(1) << (i + 1), s.max_ns);
+            if (!s.p50_ns && acc*2 >= n)
+                s.p50_ns = upper;
+            if (acc*100 >= n*99) {
+                s.p99_ns = upper;
+                break;
+            }
+        }
+        return s;
+    }
+private:
+    enum { Buckets = 40 }; // 1ns ~ 18min
+    std::atomic<uint64_t> count_{0};
+    std::atomic<uint64_t> bytes_{0};
+    std::atomic<uint64_t> total_ns_{0};
+    std::atomic<uint64_t> max_ns_{0};
+    std::atomic<uint64_t> hist_[Buckets]{};
+};
+
+// measures the scope
+class CedarVStageTimer {
+public:
+    CedarVStageTimer(CedarVStageCounter& c, uint64_t bytes = 0) : c_(c), bytes_(bytes), t0_(std::chrono::steady_clock::now()) {}
+    ~CedarVStageTimer() {
+        c_.add(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - t0_).count(), bytes_);
+    }
+    void setBytes(uint64_t bytes) { bytes_ = bytes; }
+private:
+    CedarVStageCounter& c_;
+    uint64_t bytes_;
+    std::chrono::steady_clock::time_point t0_;
+};
+
+inline std::ostream& operator<<(std::ostream& os, const CedarVStageStats& s)
+{
+    if (!s.count)
+        return os << s.name << ": 0";
+    os << s.name << ": " << s.count << ", avg " << s.total_ns/s.count/1000 << "us, p50 " << s.p50_ns/1000 << "us, p99 " << s.p99_ns/1000 << "us, max " << s.max_ns/1000 << "us";
+    if (s.bytes && s.total_ns)
+        os << ", " << s.bytes/1e6 << "MB " << double(s.bytes)*1000.0/s.total_ns << "MB/s"; // 10^6 bytes
+    return os;
+}
+MDK_NS_END
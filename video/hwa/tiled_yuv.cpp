@@ -0,0 +1,770 @@
+/*
+ * Copyright (c) 2018-2020 WangBin <wbsecg1 at gmail.com>
+ */
+#include "tiled_yuv.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#if defined(__i386__) || defined(__x86_64__)
+# if defined(__GNUC__)
+#  include <immintrin.h>
+#  define TILED_YUV_X86 1
+# endif
+#elif defined(__arm__) && defined(__linux__)
+# include <sys/auxv.h>
+# ifndef HWCAP_NEON
+#  define HWCAP_NEON (1 << 12)
+# endif
+#endif
+#if defined(__ARM_NEON) || defined(__ARM_NEON__) // always true for aarch64
+# include <arm_neon.h>
+# define TILED_YUV_NEON 1
+#endif
+
+#define TILE_LINE_BYTES 32
+#define TILE_BYTES 1024
+
+extern "C" {
+#if defined(__arm__)
+// tiled_yuv.S
+void neon_tiled_to_planar(const void *src, void *dst, unsigned int dst_pitch, unsigned int width, unsigned int height);
+void neon_tiled_deinterleave_to_planar(const void *src, void *dst1, void *dst2, unsigned int dst_pitch, unsigned int width, unsigned int height);
+#endif
+}
+
+// source data is colum major. every block is 32x32
+void map32x32_to_yuv_Y(const void* srcY, void* tarY, unsigned int dst_pitch, unsigned int coded_width, unsigned int coded_height)
+{
+    unsigned long offset;
+    unsigned char *ptr = (unsigned char *)srcY;
+    const unsigned int mb_width = (coded_width+15) >> 4;
+    const unsigned int mb_height = (coded_height+15) >> 4;
+    const unsigned int twomb_line = (mb_height+1) >> 1;
+    const unsigned int recon_width = (mb_width+1) & 0xfffffffe;
+
+    for (unsigned int i = 0; i < twomb_line; i++) {
+        const unsigned int M = 32*i;
+        for (unsigned int j = 0; j < recon_width; j+=2) {
+            const unsigned int n = j*16;
+            offset = M*dst_pitch + n;
+            for (unsigned int l = 0; l < 32; l++) {
+                if (M+l < coded_height) {
+                    if (n+16 < coded_width) {
+                        //1st & 2nd mb
+                        memcpy((unsigned char *)tarY+offset, ptr, 32);
+                    } else if (n<coded_width) {
+                        // 1st mb
+                        memcpy((unsigned char *)tarY+offset, ptr, 16);
+                    }
+                    offset += dst_pitch;
+                }
+                ptr += 32;
+            }
+        }
+    }
+}
+
+void map32x32_to_yuv_C(const void* srcC, void* tarCb, void* tarCr, unsigned int dst_pitch, unsigned int coded_width, unsigned int coded_height)
+{
+    coded_width /= 2; // libvdpau-sunxi compatible
+    unsigned char line[32];
+    unsigned long offset;
+    unsigned char *ptr = (unsigned char *)srcC;
+    const unsigned int mb_width = (coded_width+7) >> 3;
+    const unsigned int mb_height = (coded_height+7) >> 3;
+    const unsigned int fourmb_line = (mb_height+3) >> 2;
+    const unsigned int recon_width = (mb_width+1) & 0xfffffffe;
+
+    for (unsigned int i = 0; i < fourmb_line; i++) {
+        const int M = i*32;
+        for (unsigned int j = 0; j < recon_width; j+=2) {
+            const unsigned int n = j*8;
+            offset = M*dst_pitch + n;
+            for (unsigned int l = 0; l < 32; l++) {
+                if (M+l < coded_height) {
+                    if (n+8 < coded_width) {
+                        // 1st & 2nd mb
+                        memcpy(line, ptr, 32);
+                        //unsigned char *line = ptr;
+                        for (int k = 0; k < 16; k++) {
+                            *((unsigned char *)tarCb + offset + k) = line[2*k];
+                            *((unsigned char *)tarCr + offset + k) = line[2*k+1];
+                        }
+                    } else if (n < coded_width) {
+                        // 1st mb
+                        memcpy(line, ptr, 16);
+                        //unsigned char *line = ptr;
+                        for (int k = 0; k < 8; k++) {
+                            *((unsigned char *)tarCb + offset + k) = line[2*k];
+                            *((unsigned char *)tarCr + offset + k) = line[2*k+1];
+                        }
+                    }
+                    offset += dst_pitch;
+                }
+                ptr += 32;
+            }
+        }
+    }
+}
+
+static inline const uint8_t* tiled_line(const void* src, unsigned width, unsigned y)
+{
+    const unsigned tiles = (width + TILE_LINE_BYTES - 1)/TILE_LINE_BYTES;
+    return (const uint8_t*)src + (y/32)*tiles*TILE_BYTES + (y%32)*TILE_LINE_BYTES;
+}
+
+static void tiled_to_planar(copy_line_t copy_line, const void* src, void* dst, unsigned int dst_pitch, unsigned int width, unsigned int height)
+{
+    for (unsigned y = 0; y < height; ++y)
+        copy_line(tiled_line(src, width, y), (uint8_t*)dst + y*dst_pitch, width);
+}
+
+static void tiled_deinterleave_to_planar(deinterleave_line_t deinterleave_line, const void* src, void* dst1, void* dst2, unsigned int dst_pitch, unsigned int width, unsigned int height)
+{
+    for (unsigned y = 0; y < height; ++y)
+        deinterleave_line(tiled_line(src, width, y), (uint8_t*)dst1 + y*dst_pitch, (uint8_t*)dst2 + y*dst_pitch, width);
+}
+
+static inline void copy_line_rest(const uint8_t* src, uint8_t* dst, unsigned rest)
+{
+    memcpy(dst, src, rest);
+}
+
+static inline void deinterleave_line_rest(const uint8_t* src, uint8_t* dst1, uint8_t* dst2, unsigned rest)
+{
+    for (unsigned k = 0; k < rest/2; ++k) {
+        dst1[k] = src[2*k];
+        dst2[k] = src[2*k+1];
+    }
+}
+
+static void scalar_copy_line(const uint8_t* src, uint8_t* dst, unsigned width)
+{
+    for (unsigned n = width/TILE_LINE_BYTES; n > 0; --n, src += TILE_BYTES, dst += TILE_LINE_BYTES)
+        memcpy(dst, src, TILE_LINE_BYTES);
+    copy_line_rest(src, dst, width % TILE_LINE_BYTES);
+}
+
+static void scalar_deinterleave_line(const uint8_t* src, uint8_t* dst1, uint8_t* dst2, unsigned width)
+{
+    for (unsigned n = width/TILE_LINE_BYTES; n > 0; --n, src += TILE_BYTES, dst1 += TILE_LINE_BYTES/2, dst2 += TILE_LINE_BYTES/2)
+        deinterleave_line_rest(src, dst1, dst2, TILE_LINE_BYTES);
+    deinterleave_line_rest(src, dst1, dst2, width % TILE_LINE_BYTES);
+}
+
+static inline uint8_t clamp_u8(int v)
+{
+    return v < 0 ? 0 : (v > 255 ? 255 : v);
+}
+
+// SIMD kernels use saturated 16bit arithmetic, the result is the same after clamping
+static inline void yuv_to_rgb_rest(const uint8_t* y, const uint8_t* uv, uint8_t* dst, unsigned width, const tiled_rgb_params* p)
+{
+    const int bpp = tiled_rgb_bpp(p->format);
+    const int r = p->format == TILED_BGRA ? 2 : 0;
+    for (unsigned i = 0; i < width; ++i, dst += bpp) {
+        const int du = uv[i & ~1u] - 128;
+        const int dv = uv[i | 1u] - 128;
+        const int yt = (y[i] - p->y_offset)*p->y_mul + 32;
+        dst[r] = clamp_u8((yt + p->rv*dv) >> 6);
+        dst[1] = clamp_u8((yt - (p->gu*du + p->gv*dv)) >> 6);
+        dst[2 - r] = clamp_u8((yt + p->bu*du) >> 6);
+        if (bpp == 4)
+            dst[3] = 255;
+    }
+}
+
+static void scalar_rgb_line(const uint8_t* y, const uint8_t* uv, uint8_t* dst, unsigned width, const tiled_rgb_params* p)
+{
+    const int bpp = tiled_rgb_bpp(p->format);
+    for (unsigned n = width/TILE_LINE_BYTES; n > 0; --n, y += TILE_BYTES, uv += TILE_BYTES, dst += TILE_LINE_BYTES*bpp)
+        yuv_to_rgb_rest(y, uv, dst, TILE_LINE_BYTES, p);
+    yuv_to_rgb_rest(y, uv, dst, width % TILE_LINE_BYTES, p);
+}
+
+static inline void accumulate_line_rest(const uint8_t* src, uint16_t* acc, unsigned rest)
+{
+    for (unsigned k = 0; k < rest; ++k)
+        acc[k] += src[k];
+}
+
+static void scalar_accumulate_line(const uint8_t* src, uint16_t* acc, unsigned width)
+{
+    for (unsigned n = width/TILE_LINE_BYTES; n > 0; --n, src += TILE_BYTES, acc += TILE_LINE_BYTES)
+        accumulate_line_rest(src, acc, TILE_LINE_BYTES);
+    accumulate_line_rest(src, acc, width % TILE_LINE_BYTES);
+}
+
+static void scalar_tiled_to_planar(const void* src, void* dst, unsigned int dst_pitch, unsigned int width, unsigned int height)
+{
+    tiled_to_planar(scalar_copy_line, src, dst, dst_pitch, width, height);
+}
+
+static void scalar_tiled_deinterleave_to_planar(const void* src, void* dst1, void* dst2, unsigned int dst_pitch, unsigned int width, unsigned int height)
+{
+    tiled_deinterleave_to_planar(scalar_deinterleave_line, src, dst1, dst2, dst_pitch, width, height);
+}
+
+#if (TILED_YUV_X86+0)
+__attribute__((target("sse2")))
+static void sse2_copy_line(const uint8_t* src, uint8_t* dst, unsigned width)
+{
+    for (unsigned n = width/TILE_LINE_BYTES; n > 0; --n, src += TILE_BYTES, dst += TILE_LINE_BYTES) {
+        const __m128i a = _mm_loadu_si128((const __m128i*)src);
+        const __m128i b = _mm_loadu_si128((const __m128i*)(src + 16));
+        _mm_storeu_si128((__m128i*)dst, a);
+        _mm_storeu_si128((__m128i*)(dst + 16), b);
+    }
+    copy_line_rest(src, dst, width % TILE_LINE_BYTES);
+}
+
+__attribute__((target("sse2")))
+static void sse2_deinterleave_line(const uint8_t* src, uint8_t* dst1, uint8_t* dst2, unsigned width)
+{
+    const __m128i mask = _mm_set1_epi16(0x00ff);
+    for (unsigned n = width/TILE_LINE_BYTES; n > 0; --n, src += TILE_BYTES, dst1 += 16, dst2 += 16) {
+        const __m128i a = _mm_loadu_si128((const __m128i*)src);
+        const __m128i b = _mm_loadu_si128((const __m128i*)(src + 16));
+        _mm_storeu_si128((__m128i*)dst1, _mm_packus_epi16(_mm_and_si128(a, mask), _mm_and_si128(b, mask)));
+        _mm_storeu_si128((__m128i*)dst2, _mm_packus_epi16(_mm_srli_epi16(a, 8), _mm_srli_epi16(b, 8)));
+    }
+    deinterleave_line_rest(src, dst1, dst2, width % TILE_LINE_BYTES);
+}
+
+__attribute__((target("sse2")))
+static void sse2_rgb_line(const uint8_t* y, const uint8_t* uv, uint8_t* dst, unsigned width, const tiled_rgb_params* p)
+{
+    const int bpp = tiled_rgb_bpp(p->format);
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i mask = _mm_set1_epi16(0x00ff);
+    const __m128i c128 = _mm_set1_epi16(128);
+    const __m128i rnd = _mm_set1_epi16(32);
+    const __m128i yoff = _mm_set1_epi16(p->y_offset);
+    const __m128i ymul = _mm_set1_epi16(p->y_mul);
+    const __m128i rv = _mm_set1_epi16(p->rv);
+    const __m128i gu = _mm_set1_epi16(p->gu);
+    const __m128i gv = _mm_set1_epi16(p->gv);
+    const __m128i bu = _mm_set1_epi16(p->bu);
+    const __m128i alpha = _mm_set1_epi8(-1);
+    for (unsigned n = width/TILE_LINE_BYTES; n > 0; --n, y += TILE_BYTES, uv += TILE_BYTES, dst += TILE_LINE_BYTES*bpp) {
+        for (int h = 0; h < 2; ++h) { // 16 pixels and 8 uv pairs
+            const __m128i yy = _mm_loadu_si128((const __m128i*)(y + 16*h));
+            const __m128i c = _mm_loadu_si128((const __m128i*)(uv + 16*h));
+            const __m128i du = _mm_sub_epi16(_mm_and_si128(c, mask), c128);
+            const __m128i dv = _mm_sub_epi16(_mm_srli_epi16(c, 8), c128);
+            const __m128i rt = _mm_mullo_epi16(dv, rv);
+            const __m128i gt = _mm_add_epi16(_mm_mullo_epi16(du, gu), _mm_mullo_epi16(dv, gv));
+            const __m128i bt = _mm_mullo_epi16(du, bu);
+            const __m128i y0 = _mm_adds_epi16(_mm_mullo_epi16(_mm_sub_epi16(_mm_unpacklo_epi8(yy, zero), yoff), ymul), rnd);
+            const __m128i y1 = _mm_adds_epi16(_mm_mullo_epi16(_mm_sub_epi16(_mm_unpackhi_epi8(yy, zero), yoff), ymul), rnd);
+            __m128i r = _mm_packus_epi16(_mm_srai_epi16(_mm_adds_epi16(y0, _mm_unpacklo_epi16(rt, rt)), 6), _mm_srai_epi16(_mm_adds_epi16(y1, _mm_unpackhi_epi16(rt, rt)), 6));
+            const __m128i g = _mm_packus_epi16(_mm_srai_epi16(_mm_subs_epi16(y0, _mm_unpacklo_epi16(gt, gt)), 6), _mm_srai_epi16(_mm_subs_epi16(y1, _mm_unpackhi_epi16(gt, gt)), 6));
+            __m128i b = _mm_packus_epi16(_mm_srai_epi16(_mm_adds_epi16(y0, _mm_unpacklo_epi16(bt, bt)), 6), _mm_srai_epi16(_mm_adds_epi16(y1, _mm_unpackhi_epi16(bt, bt)), 6));
+            if (bpp == 3) {
+                alignas(16) uint8_t rgb[3][16];
+                _mm_store_si128((__m128i*)rgb[0], r);
+                _mm_store_si128((__m128i*)rgb[1], g);
+                _mm_store_si128((__m128i*)rgb[2], b);
+                uint8_t* d = dst + 48*h;
+                for (int i = 0; i < 16; ++i, d += 3) {
+                    d[0] = rgb[0][i];
+                    d[1] = rgb[1][i];
+                    d[2] = rgb[2][i];
+                }
+                continue;
+            }
+            if (p->format == TILED_BGRA)
+                std::swap(r, b);
+            const __m128i rg0 = _mm_unpacklo_epi8(r, g);
+            const __m128i rg1 = _mm_unpackhi_epi8(r, g);
+            const __m128i ba0 = _mm_unpacklo_epi8(b, alpha);
+            const __m128i ba1 = _mm_unpackhi_epi8(b, alpha);
+            __m128i* d = (__m128i*)(dst + 64*h);
+            _mm_storeu_si128(d, _mm_unpacklo_epi16(rg0, ba0));
+            _mm_storeu_si128(d + 1, _mm_unpackhi_epi16(rg0, ba0));
+            _mm_storeu_si128(d + 2, _mm_unpacklo_epi16(rg1, ba1));
+            _mm_storeu_si128(d + 3, _mm_unpackhi_epi16(rg1, ba1));
+        }
+    }
+    yuv_to_rgb_rest(y, uv, dst, width % TILE_LINE_BYTES, p);
+}
+
+__attribute__((target("sse2")))
+static void sse2_accumulate_line(const uint8_t* src, uint16_t* acc, unsigned width)
+{
+    const __m128i zero = _mm_setzero_si128();
+    for (unsigned n = width/TILE_LINE_BYTES; n > 0; --n, src += TILE_BYTES, acc += TILE_LINE_BYTES) {
+        for (int h = 0; h < 2; ++h) {
+            const __m128i v = _mm_loadu_si128((const __m128i*)(src + 16*h));
+            __m128i* a = (__m128i*)(acc + 16*h);
+            _mm_storeu_si128(a, _mm_add_epi16(_mm_loadu_si128(a), _mm_unpacklo_epi8(v, zero)));
+            _mm_storeu_si128(a + 1, _mm_add_epi16(_mm_loadu_si128(a + 1), _mm_unpackhi_epi8(v, zero)));
+        }
+    }
+    accumulate_line_rest(src, acc, width % TILE_LINE_BYTES);
+}
+
+static void sse2_tiled_to_planar(const void* src, void* dst, unsigned int dst_pitch, unsigned int width, unsigned int height)
+{
+    tiled_to_planar(sse2_copy_line, src, dst, dst_pitch, width, height);
+}
+
+static void sse2_tiled_deinterleave_to_planar(const void* src, void* dst1, void* dst2, unsigned int dst_pitch, unsigned int width, unsigned int height)
+{
+    tiled_deinterleave_to_planar(sse2_deinterleave_line, src, dst1, dst2, dst_pitch, width, height);
+}
+
+__attribute__((target("avx2")))
+static void avx2_copy_line(const uint8_t* src, uint8_t* dst, unsigned width)
+{
+    unsigned n = width/TILE_LINE_BYTES;
+    for (; n >= 2; n -= 2, src += 2*TILE_BYTES, dst += 2*TILE_LINE_BYTES) {
+        const __m256i a = _mm256_loadu_si256((const __m256i*)src);
+        const __m256i b = _mm256_loadu_si256((const __m256i*)(src + TILE_BYTES));
+        _mm256_storeu_si256((__m256i*)dst, a);
+        _mm256_storeu_si256((__m256i*)(dst + TILE_LINE_BYTES), b);
+    }
+    if (n) {
+        _mm256_storeu_si256((__m256i*)dst, _mm256_loadu_si256((const __m256i*)src));
+        src += TILE_BYTES;
+        dst += TILE_LINE_BYTES;
+    }
+    copy_line_rest(src, dst, width % TILE_LINE_BYTES);
+}
+
+__attribute__((target("avx2")))
+static void avx2_deinterleave_line(const uint8_t* src, uint8_t* dst1, uint8_t* dst2, unsigned width)
+{
+    // even bytes to the low 8 bytes of each lane, odd bytes to the high 8 bytes, then gather lanes as [u0 u1 v0 v1]
+    const __m256i shuf = _mm256_setr_epi8(0, 2, 4, 6, 8, 10, 12, 14, 1, 3, 5, 7, 9, 11, 13, 15
+                                        , 0, 2, 4, 6, 8, 10, 12, 14, 1, 3, 5, 7, 9, 11, 13, 15);
+    for (unsigned n = width/TILE_LINE_BYTES; n > 0; --n, src += TILE_BYTES, dst1 += 16, dst2 += 16) {
+        const __m256i a = _mm256_permute4x64_epi64(_mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i*)src), shuf), _MM_SHUFFLE(3, 1, 2, 0));
+        _mm_storeu_si128((__m128i*)dst1, _mm256_castsi256_si128(a));
+        _mm_storeu_si128((__m128i*)dst2, _mm256_extracti128_si256(a, 1));
+    }
+    deinterleave_line_rest(src, dst1, dst2, width % TILE_LINE_BYTES);
+}
+
+static void avx2_tiled_to_planar(const void* src, void* dst, unsigned int dst_pitch, unsigned int width, unsigned int height)
+{
+    tiled_to_planar(avx2_copy_line, src, dst, dst_pitch, width, height);
+}
+
+static void avx2_tiled_deinterleave_to_planar(const void* src, void* dst1, void* dst2, unsigned int dst_pitch, unsigned int width, unsigned int height)
+{
+    tiled_deinterleave_to_planar(avx2_deinterleave_line, src, dst1, dst2, dst_pitch, width, height);
+}
+#endif // TILED_YUV_X86
+
+#if (TILED_YUV_NEON+0)
+static void neon_copy_line(const uint8_t* src, uint8_t* dst, unsigned width)
+{
+    for (unsigned n = width/TILE_LINE_BYTES; n > 0; --n, src += TILE_BYTES, dst += TILE_LINE_BYTES) {
+        __builtin_prefetch(src + TILE_BYTES);
+        const uint8x16_t a = vld1q_u8(src);
+        const uint8x16_t b = vld1q_u8(src + 16);
+        vst1q_u8(dst, a);
+        vst1q_u8(dst + 16, b);
+    }
+    copy_line_rest(src, dst, width % TILE_LINE_BYTES);
+}
+
+static void neon_deinterleave_line(const uint8_t* src, uint8_t* dst1, uint8_t* dst2, unsigned width)
+{
+    for (unsigned n = width/TILE_LINE_BYTES; n > 0; --n, src += TILE_BYTES, dst1 += 16, dst2 += 16) {
+        __builtin_prefetch(src + TILE_BYTES);
+        const uint8x16x2_t uv = vld2q_u8(src);
+        vst1q_u8(dst1, uv.val[0]);
+        vst1q_u8(dst2, uv.val[1]);
+    }
+    deinterleave_line_rest(src, dst1, dst2, width % TILE_LINE_BYTES);
+}
+static void neon_rgb_line(const uint8_t* y, const uint8_t* uv, uint8_t* dst, unsigned width, const tiled_rgb_params* p)
+{
+    const int bpp = tiled_rgb_bpp(p->format);
+    const int16x8_t c128 = vdupq_n_s16(128);
+    const int16x8_t rnd = vdupq_n_s16(32);
+    const int16x8_t yoff = vdupq_n_s16(p->y_offset);
+    const int16x8_t ymul = vdupq_n_s16(p->y_mul);
+    const int16x8_t rv = vdupq_n_s16(p->rv);
+    const int16x8_t gu = vdupq_n_s16(p->gu);
+    const int16x8_t gv = vdupq_n_s16(p->gv);
+    const int16x8_t bu = vdupq_n_s16(p->bu);
+    const uint8x16_t alpha = vdupq_n_u8(255);
+    for (unsigned n = width/TILE_LINE_BYTES; n > 0; --n, y += TILE_BYTES, uv += TILE_BYTES, dst += TILE_LINE_BYTES*bpp) {
+        for (int h = 0; h < 2; ++h) { // 16 pixels and 8 uv pairs
+            const uint8x16_t yy = vld1q_u8(y + 16*h);
+            const uint8x8x2_t c = vld2_u8(uv + 16*h);
+            const int16x8_t du = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(c.val[0])), c128);
+            const int16x8_t dv = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(c.val[1])), c128);
+            const int16x8x2_t rt = vzipq_s16(vmulq_s16(dv, rv), vmulq_s16(dv, rv));
+            const int16x8_t gt1 = vaddq_s16(vmulq_s16(du, gu), vmulq_s16(dv, gv));
+            const int16x8x2_t gt = vzipq_s16(gt1, gt1);
+            const int16x8x2_t bt = vzipq_s16(vmulq_s16(du, bu), vmulq_s16(du, bu));
+            const int16x8_t y0 = vqaddq_s16(vmulq_s16(vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(vget_low_u8(yy))), yoff), ymul), rnd);
+            const int16x8_t y1 = vqaddq_s16(vmulq_s16(vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(vget_high_u8(yy))), yoff), ymul), rnd);
+            const uint8x16_t r = vcombine_u8(vqmovun_s16(vshrq_n_s16(vqaddq_s16(y0, rt.val[0]), 6)), vqmovun_s16(vshrq_n_s16(vqaddq_s16(y1, rt.val[1]), 6)));
+            const uint8x16_t g = vcombine_u8(vqmovun_s16(vshrq_n_s16(vqsubq_s16(y0, gt.val[0]), 6)), vqmovun_s16(vshrq_n_s16(vqsubq_s16(y1, gt.val[1]), 6)));
+            const uint8x16_t b = vcombine_u8(vqmovun_s16(vshrq_n_s16(vqaddq_s16(y0, bt.val[0]), 6)), vqmovun_s16(vshrq_n_s16(vqaddq_s16(y1, bt.val[1]), 6)));
+            if (bpp == 3) {
+                const uint8x16x3_t v = {{r, g, b}};
+                vst3q_u8(dst + 48*h, v);
+            } else if (p->format == TILED_BGRA) {
+                const uint8x16x4_t v = {{b, g, r, alpha}};
+                vst4q_u8(dst + 64*h, v);
+            } else {
+                const uint8x16x4_t v = {{r, g, b, alpha}};
+                vst4q_u8(dst + 64*h, v);
+            }
+        }
+    }
+    yuv_to_rgb_rest(y, uv, dst, width % TILE_LINE_BYTES, p);
+}
+static void neon_accumulate_line(const uint8_t* src, uint16_t* acc, unsigned width)
+{
+    for (unsigned n = width/TILE_LINE_BYTES; n > 0; --n, src += TILE_BYTES, acc += TILE_LINE_BYTES) {
+        for (int h = 0; h < 2; ++h) {
+            const uint8x16_t v = vld1q_u8(src + 16*h);
+            uint16_t* a = acc + 16*h;
+            vst1q_u16(a, vaddw_u8(vld1q_u16(a), vget_low_u8(v)));
+            vst1q_u16(a + 8, vaddw_u8(vld1q_u16(a + 8), vget_high_u8(v)));
+        }
+    }
+    accumulate_line_rest(src, acc, width % TILE_LINE_BYTES);
+}
+#endif // (TILED_YUV_NEON+0)
+
+#if defined(__aarch64__)
+static void neon64_tiled_to_planar(const void* src, void* dst, unsigned int dst_pitch, unsigned int width, unsigned int height)
+{
+    tiled_to_planar(neon_copy_line, src, dst, dst_pitch, width, height);
+}
+
+static void neon64_tiled_deinterleave_to_planar(const void* src, void* dst1, void* dst2, unsigned int dst_pitch, unsigned int width, unsigned int height)
+{
+    tiled_deinterleave_to_planar(neon_deinterleave_line, src, dst1, dst2, dst_pitch, width, height);
+}
+#endif // defined(__aarch64__)
+
+static const tiled_yuv_kernels* supported_kernels(int* count)
+{
+    static tiled_yuv_kernels k[8]{};
+    static int n = [&]{
+        int i = 0;
+        k[i++] = {"C", map32x32_to_yuv_Y, map32x32_to_yuv_C, scalar_copy_line, scalar_deinterleave_line, scalar_rgb_line, scalar_accumulate_line};
+        k[i++] = {"scalar", scalar_tiled_to_planar, scalar_tiled_deinterleave_to_planar, scalar_copy_line, scalar_deinterleave_line, scalar_rgb_line, scalar_accumulate_line};
+#if (TILED_YUV_X86+0)
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("sse2"))
+            k[i++] = {"sse2", sse2_tiled_to_planar, sse2_tiled_deinterleave_to_planar, sse2_copy_line, sse2_deinterleave_line, sse2_rgb_line, sse2_accumulate_line};
+        if (__builtin_cpu_supports("avx2"))
+            k[i++] = {"avx2", avx2_tiled_to_planar, avx2_tiled_deinterleave_to_planar, avx2_copy_line, avx2_deinterleave_line, sse2_rgb_line, sse2_accumulate_line};
+#elif defined(__aarch64__)
+        k[i++] = {"neon64", neon64_tiled_to_planar, neon64_tiled_deinterleave_to_planar, neon_copy_line, neon_deinterleave_line, neon_rgb_line, neon_accumulate_line};
+#elif defined(__arm__) && defined(__linux__)
+        if (getauxval(AT_HWCAP) & HWCAP_NEON)
+# if (TILED_YUV_NEON+0)
+            k[i++] = {"neon", neon_tiled_to_planar, neon_tiled_deinterleave_to_planar, neon_copy_line, neon_deinterleave_line, neon_rgb_line, neon_accumulate_line};
+# else
+            k[i++] = {"neon", neon_tiled_to_planar, neon_tiled_deinterleave_to_planar, scalar_copy_line, scalar_deinterleave_line, scalar_rgb_line, scalar_accumulate_line};
+# endif
+#endif
+        return i;
+    }();
+    *count = n;
+    return k;
+}
+
+const tiled_yuv_kernels* tiled_yuv_kernels_supported(int* count)
+{
+    return supported_kernels(count);
+}
+
+const tiled_yuv_kernels* tiled_yuv_kernels_select()
+{
+    int n = 0;
+    const auto k = supported_kernels(&n);
+    return &k[n - 1];
+}
+
+const tiled_yuv_kernels* tiled_yuv_kernels_find(const char* name)
+{
+    int n = 0;
+    const auto k = supported_kernels(&n);
+    for (int i = 0; i < n; ++i) {
+        if (strcmp(k[i].name, name) == 0)
+            return &k[i];
+    }
+    return nullptr;
+}
+
+static inline bool tiled_scaled(const tiled_plane& p)
+{
+    return p.scale > 1 && !p.rgb;
+}
+
+// output lines of a band
+static inline unsigned tiled_band_lines(const tiled_plane& p)
+{
+    return tiled_scaled(p) ? 32/p.scale : 32;
+}
+
+static inline unsigned tiled_bands(const tiled_plane& p)
+{
+    const unsigned h = tiled_scaled(p) ? p.height/p.scale : p.height;
+    return (h + tiled_band_lines(p) - 1)/tiled_band_lines(p);
+}
+
+static inline bool tiled_partial(const tiled_plane& p)
+{
+    return p.x > 0 || p.y > 0 || (p.src_width > 0 && p.src_width != p.width);
+}
+
+// lines [y0, y0 + h) of the rectangle. only tiles intersecting the rectangle are read
+static void convert_rect_lines(const tiled_yuv_kernels* k, const tiled_plane& p, unsigned y0, unsigned h)
+{
+    const unsigned src_width = p.src_width ? p.src_width : p.width;
+    const unsigned tiles = (src_width + TILE_LINE_BYTES - 1)/TILE_LINE_BYTES;
+    const unsigned head = p.x % TILE_LINE_BYTES ? std::min(TILE_LINE_BYTES - p.x % TILE_LINE_BYTES, p.width) : 0;
+    for (unsigned y = y0; y < y0 + h; ++y) {
+        const unsigned sy = p.y + y;
+        const uint8_t* src = (const uint8_t*)p.src + (sy/32)*tiles*TILE_BYTES + (p.x/TILE_LINE_BYTES)*TILE_BYTES + (sy%32)*TILE_LINE_BYTES;
+        uint8_t* dst = (uint8_t*)p.dst[0] + size_t(y)*p.pitch;
+        if (p.deinterleave) {
+            uint8_t* dst2 = (uint8_t*)p.dst[1] + size_t(y)*p.pitch;
+            if (head) {
+                deinterleave_line_rest(src + p.x % TILE_LINE_BYTES, dst, dst2, head);
+                src += TILE_BYTES;
+                dst += head/2;
+                dst2 += head/2;
+            }
+            k->deinterleave_line(src, dst, dst2, p.width - head);
+        } else {
+            if (head) {
+                copy_line_rest(src + p.x % TILE_LINE_BYTES, dst, head);
+                src += TILE_BYTES;
+                dst += head;
+            }
+            k->copy_line(src, dst, p.width - head);
+        }
+    }
+}
+
+// lines [y0, y0 + h) of the rgb rectangle. the chroma line of a luma line y is y/2
+static void convert_rgb_lines(const tiled_yuv_kernels* k, const tiled_plane& p, unsigned y0, unsigned h)
+{
+    const unsigned src_width = p.src_width ? p.src_width : p.width;
+    const unsigned tiles = (src_width + TILE_LINE_BYTES - 1)/TILE_LINE_BYTES;
+    const unsigned head = p.x % TILE_LINE_BYTES ? std::min(TILE_LINE_BYTES - p.x % TILE_LINE_BYTES, p.width) : 0;
+    const int bpp = tiled_rgb_bpp(p.rgb->format);
+    for (unsigned y = y0; y < y0 + h; ++y) {
+        const unsigned sy = p.y + y;
+        const unsigned cy = sy/2;
+        const uint8_t* src = (const uint8_t*)p.src + (sy/32)*tiles*TILE_BYTES + (p.x/TILE_LINE_BYTES)*TILE_BYTES + (sy%32)*TILE_LINE_BYTES;
+        const uint8_t* src2 = (const uint8_t*)p.src2 + (cy/32)*tiles*TILE_BYTES + (p.x/TILE_LINE_BYTES)*TILE_BYTES + (cy%32)*TILE_LINE_BYTES;
+        uint8_t* dst = (uint8_t*)p.dst[0] + size_t(y)*p.pitch;
+        if (head) {
+            yuv_to_rgb_rest(src + p.x % TILE_LINE_BYTES, src2 + p.x % TILE_LINE_BYTES, dst, head, p.rgb);
+            src += TILE_BYTES;
+            src2 += TILE_BYTES;
+            dst += head*bpp;
+        }
+        k->rgb_line(src, src2, dst, p.width - head, p.rgb);
+    }
+}
+
+// output lines [y0, y0 + h) of the downscaled rectangle. sum scale lines, then sum scale bytes(or uv pairs) horizontally
+static void convert_scaled_lines(const tiled_yuv_kernels* k, const tiled_plane& p, unsigned y0, unsigned h)
+{
+    enum { Chunk = 2048 }; // source bytes per pass, a multiple of 2x8
+    uint16_t acc[Chunk];
+    const unsigned s = p.scale;
+    const unsigned shift = s == 2 ? 2 : (s == 4 ? 4 : 6);
+    const unsigned rnd = 1 << (shift - 1);
+    const unsigned src_width = p.src_width ? p.src_width : p.width;
+    const unsigned tiles = (src_width + TILE_LINE_BYTES - 1)/TILE_LINE_BYTES;
+    for (unsigned y = y0; y < y0 + h; ++y) {
+        uint8_t* dst = (uint8_t*)p.dst[0] + size_t(y)*p.pitch;
+        uint8_t* dst2 = p.deinterleave ? (uint8_t*)p.dst[1] + size_t(y)*p.pitch : nullptr;
+        for (unsigned c = 0; c < p.width; c += Chunk) {
+            const unsigned n = std::min<unsigned>(Chunk, p.width - c);
+            const unsigned sx = p.x + c;
+            const unsigned head = sx % TILE_LINE_BYTES ? std::min(TILE_LINE_BYTES - sx % TILE_LINE_BYTES, n) : 0;
+            memset(acc, 0, n*sizeof(acc[0]));
+            for (unsigned r = 0; r < s; ++r) {
+                const unsigned sy = p.y + y*s + r;
+                const uint8_t* src = (const uint8_t*)p.src + (sy/32)*tiles*TILE_BYTES + (sx/TILE_LINE_BYTES)*TILE_BYTES + (sy%32)*TILE_LINE_BYTES;
+                if (head) {
+                    accumulate_line_rest(src + sx % TILE_LINE_BYTES, acc, head);
+                    src += TILE_BYTES;
+                }
+                k->accumulate_line(src, acc + head, n - head);
+            }
+            if (!p.chroma) {
+                for (unsigned i = 0; i < n/s; ++i) {
+                    unsigned sum = rnd;
+                    for (unsigned j = 0; j < s; ++j)
+                        sum += acc[i*s + j];
+                    dst[c/s + i] = uint8_t(sum >> shift);
+                }
+                continue;
+            }
+            for (unsigned i = 0; i < n/(2*s); ++i) {
+                unsigned u = rnd, v = rnd;
+                for (unsigned j = 0; j < s; ++j) {
+                    u += acc[2*(i*s + j)];
+                    v += acc[2*(i*s + j) + 1];
+                }
+                if (dst2) {
+                    dst[c/(2*s) + i] = uint8_t(u >> shift);
+                    dst2[c/(2*s) + i] = uint8_t(v >> shift);
+                } else {
+                    dst[c/s + 2*i] = uint8_t(u >> shift);
+                    dst[c/s + 2*i + 1] = uint8_t(v >> shift);
+                }
+            }
+        }
+    }
+}
+
+static void convert_band(const tiled_yuv_kernels* k, const tiled_plane& p, unsigned band)
+{
+    if (tiled_scaled(p)) {
+        const unsigned lines = tiled_band_lines(p);
+        const unsigned oh = p.height/p.scale;
+        convert_scaled_lines(k, p, band*lines, std::min(lines, oh - band*lines));
+        return;
+    }
+    const unsigned h = p.height - band*32 < 32 ? p.height - band*32 : 32;
+    if (p.rgb) {
+        convert_rgb_lines(k, p, band*32, h);
+        return;
+    }
+    if (tiled_partial(p)) {
+        convert_rect_lines(k, p, band*32, h);
+        return;
+    }
+    const unsigned tiles = (p.width + TILE_LINE_BYTES - 1)/TILE_LINE_BYTES;
+    const uint8_t* src = (const uint8_t*)p.src + band*tiles*TILE_BYTES;
+    const size_t offset = size_t(band)*32*p.pitch;
+    if (p.deinterleave)
+        k->map_c(src, (uint8_t*)p.dst[0] + offset, (uint8_t*)p.dst[1] + offset, p.pitch, p.width, h);
+    else
+        k->map_y(src, (uint8_t*)p.dst[0] + offset, p.pitch, p.width, h);
+}
+
+void tiled_convert(const tiled_yuv_kernels* k, const tiled_plane* planes, int count)
+{
+    for (int i = 0; i < count; ++i) {
+        const tiled_plane& p = planes[i];
+        if (tiled_scaled(p))
+            convert_scaled_lines(k, p, 0, p.height/p.scale);
+        else if (p.rgb)
+            convert_rgb_lines(k, p, 0, p.height);
+        else if (tiled_partial(p))
+            convert_rect_lines(k, p, 0, p.height);
+        else if (p.deinterleave)
+            k->map_c(p.src, p.dst[0], p.dst[1], p.pitch, p.width, p.height);
+        else
+            k->map_y(p.src, p.dst[0], p.pitch, p.width, p.height);
+    }
+}
+
+TiledWorkers::TiledWorkers(int threads)
+{
+    for (int i = 1; i < threads; ++i)
+        workers_.emplace_back(&TiledWorkers::run, this);
+}
+
+TiledWorkers::~TiledWorkers()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+    }
+    cv_.notify_all();
+    for (auto& t : workers_)
+        t.join();
+}
+
+void TiledWorkers::convert(const tiled_yuv_kernels* k, const tiled_plane* planes, int count)
+{
+    std::unique_lock<std::mutex> job_lock(job_mutex_, std::try_to_lock);
+    if (!job_lock.owns_lock() || workers_.empty()) {
+        tiled_convert(k, planes, count);
+        return;
+    }
+    int bands = 0;
+    for (int i = 0; i < count; ++i)
+        bands += tiled_bands(planes[i]);
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        k_ = k;
+        planes_ = planes;
+        count_ = count;
+        bands_ = bands;
+        next_ = 0;
+        done_ = 0;
+        ++job_id_;
+    }
+    cv_.notify_all();
+    convertBands();
+    std::unique_lock<std::mutex> lock(mutex_); // bands may be still converting by workers
+    done_cv_.wait(lock, [this]{ return done_ == bands_ && active_ == 0; });
+    planes_ = nullptr; // workers may wake up late and must not touch the finished job
+}
+
+void TiledWorkers::convertBands()
+{
+    // bands of all planes are numbered continuously, so y and uv bands are converted concurrently
+    for (int b = next_++; b < bands_; b = next_++) {
+        int i = 0;
+        int band = b;
+        while (band >= (int)tiled_bands(planes_[i]))
+            band -= tiled_bands(planes_[i++]);
+        convert_band(k_, planes_[i], band);
+        ++done_;
+    }
+}
+
+void TiledWorkers::run()
+{
+    unsigned job_id = 0;
+    while (true) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cv_.wait(lock, [&]{ return stop_ || job_id != job_id_; });
+        if (stop_)
+            return;
+        job_id = job_id_;
+        if (!planes_)
+            continue;
+        ++active_;
+        lock.unlock();
+        convertBands();
+        lock.lock();
+        if (--active_ == 0)
+            done_cv_.notify_one();
+    }
+}
+
+int tiled_rgb_bpp(tiled_rgb_format format)
+{
+    return format == TILED_RGB24 ? 3 : 4;
+}
+
+void tiled_rgb_params_init(tiled_rgb_params* p, tiled_rgb_format format, bool bt709, bool full_range)
+{
+    const double kr = bt709 ? 0.2126 : 0.299;
+    const double kb = bt709 ? 0.0722 : 0.114;
+    const double kg = 1.0 - kr - kb;
+    const double ys = full_range ? 1.0 : 255.0/219.0;
+    const double cs = full_range ? 1.0 : 255.0/224.0;
+    p->format = format;
+    p->y_offset = full_range ? 0 : 16;
+    p->y_mul = short(ys*64.0 + 0.5);
+    p->rv = short(2.0*(1.0 - kr)*cs*64.0 + 0.5);
+    p->gu = short(2.0*(1.0 - kb)*kb/kg*cs*64.0 + 0.5);
+    p->gv = short(2.0*(1.0 - kr)*kr/kg*cs*64.0 + 0.5);
+    p->bu = short(2.0*(1.0 - kb)*cs*64.0 + 0.5);
+}
@@ -0,0 +1,113 @@
+/*
+ * Copyright (c) 2018-2020 WangBin <wbsecg1 at gmail.com>
+ */
+// sunxi 32x32 tiled(MB32) to linear conversion. no mdk/libcedarv dependency, so kernels can be tested and benchmarked on any host.
+// tiled plane layout: tiles are row major, ceil(width/32) tiles per tile row, every tile is 32 lines x 32 bytes.
+// width is in bytes, i.e. for an interleaved uv plane, width is 2x chroma width. only width x height of dst is defined after conversion.
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+typedef void (*map_y_t)(const void* src, void* dst, unsigned int dst_pitch, unsigned int w, unsigned int h);
+typedef void (*map_c_t)(const void* src, void* dst1, void* dst2, unsigned int dst_pitch, unsigned int w, unsigned int h);
+// line kernels: src is a line start in a tile, the next tile of the tile row is 1024 bytes later. width is bytes to read
+typedef void (*copy_line_t)(const unsigned char* src, unsigned char* dst, unsigned int width);
+typedef void (*deinterleave_line_t)(const unsigned char* src, unsigned char* dst1, unsigned char* dst2, unsigned int width);
+
+enum tiled_rgb_format {
+    TILED_RGBA,
+    TILED_BGRA,
+    TILED_RGB24,
+};
+// yuv to rgb in Q6 fixed point: r = ((y - y_offset)*y_mul + rv*(v-128) + 32) >> 6 etc.
+struct tiled_rgb_params {
+    tiled_rgb_format format;
+    short y_offset;
+    short y_mul;
+    short rv;
+    short gu;
+    short gv;
+    short bu;
+};
+void tiled_rgb_params_init(tiled_rgb_params* p, tiled_rgb_format format, bool bt709, bool full_range);
+int tiled_rgb_bpp(tiled_rgb_format format);
+// y and uv are line starts in tiles of tiled luma and interleaved chroma planes. width is pixels, must be even
+typedef void (*rgb_line_t)(const unsigned char* y, const unsigned char* uv, unsigned char* dst, unsigned int width, const tiled_rgb_params* p);
+// acc[i] += src[i], src is a line start in a tile. used by downscaling
+typedef void (*accumulate_line_t)(const unsigned char* src, unsigned short* acc, unsigned int width);
+
+struct tiled_yuv_kernels {
+    const char* name;
+    map_y_t map_y; // tiled to linear
+    map_c_t map_c; // tiled interleaved to 2 linear planes
+    copy_line_t copy_line; // used by partial conversion
+    deinterleave_line_t deinterleave_line;
+    rgb_line_t rgb_line;
+    accumulate_line_t accumulate_line;
+};
+
+// reference implementation, other kernels must produce the same result
+void map32x32_to_yuv_Y(const void* srcY, void* tarY, unsigned int dst_pitch, unsigned int coded_width, unsigned int coded_height);
+void map32x32_to_yuv_C(const void* srcC, void* tarCb, void* tarCr, unsigned int dst_pitch, unsigned int coded_width, unsigned int coded_height);
+
+// kernels supported by current cpu. the 1st one is the reference, the last one is the fastest
+const tiled_yuv_kernels* tiled_yuv_kernels_supported(int* count);
+// the fastest supported kernels
+const tiled_yuv_kernels* tiled_yuv_kernels_select();
+// supported kernels by name, or null
+const tiled_yuv_kernels* tiled_yuv_kernels_find(const char* name);
+
+// a tiled plane, or a rectangle(x, y, width, height) of a tiled plane whose width is src_width, to convert.
+// x and width are in bytes, x must be even if deinterleave. dst[1] is used only if deinterleave is true
+// if rgb is not null, src is luma, src2 is interleaved chroma and dst[0] is rgb, x, y, width and height are in luma pixels and must be even
+// if scale is 2, 4 or 8, the rectangle is downscaled by averaging scale x scale blocks, width and height must be multiples of scale(2x scale for chroma)
+struct tiled_plane {
+    const void* src;
+    void* dst[2];
+    unsigned int pitch;
+    unsigned int width;
+    unsigned int height;
+    bool deinterleave;
+    unsigned int x;
+    unsigned int y;
+    unsigned int src_width; // 0: the same as width
+    const void* src2;
+    const tiled_rgb_params* rgb;
+    unsigned int scale; // 0, 1: no scale. rgb can not be scaled
+    bool chroma; // interleaved uv, required by scaling. output is interleaved if !deinterleave
+};
+
+// persistent workers converting planes by 32 line tile bands concurrently. the calling thread works too.
+class TiledWorkers {
+public:
+    // threads: total threads including the caller
+    explicit TiledWorkers(int threads);
+    ~TiledWorkers();
+    int threads() const { return int(workers_.size()) + 1; }
+    // returns when all bands are converted. if another thread is converting, run in the calling thread only
+    void convert(const tiled_yuv_kernels* k, const tiled_plane* planes, int count);
+private:
+    void run();
+    void convertBands();
+
+    std::vector<std::thread> workers_;
+    std::mutex job_mutex_; // one job at a time
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::condition_variable done_cv_;
+    bool stop_ = false;
+    unsigned job_id_ = 0;
+    const tiled_yuv_kernels* k_ = nullptr;
+    const tiled_plane* planes_ = nullptr;
+    int count_ = 0;
+    int bands_ = 0;
+    int active_ = 0; // workers working on current job
+    std::atomic<int> next_{0};
+    std::atomic<int> done_{0};
+};
+
+// single threaded
+void tiled_convert(const tiled_yuv_kernels* k, const tiled_plane* planes, int count);
@@ -0,0 +1,394 @@
+/*
+ * Copyright (c) 2018-2020 WangBin <wbsecg1 at gmail.com>
+ */
+// benchmark and golden test of tiled to linear kernels on synthetic frames. no cedar hardware is required
+// build in video/hwa, not built by the project:
+//   x86, aarch64: c++ -O2 -std=c++11 -pthread tiled_yuv_bench.cpp tiled_yuv.cpp -o tiled_yuv_bench
+//   armv7: c++ -O2 -std=c++11 -pthread -mfpu=neon tiled_yuv_bench.cpp tiled_yuv.cpp tiled_yuv.S -o tiled_yuv_bench
+// usage: tiled_yuv_bench [-n frames] [-t threads,...] [-s WxH,...] [-k kernel]
+// rows: frame(map_y/map_c), convert(tiled_convert in the calling thread), pool xN(TiledWorkers of N threads)
+// every kernel is compared byte by byte to the reference(the 1st supported kernels), exit code is the number of mismatches.
+// rgb, downscaled and sub-rectangle conversions are compared to per pixel results computed from the tiled layout, with odd pitches and unaligned destinations
+#include "tiled_yuv.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+using namespace std;
+
+struct frame_size {
+    unsigned width;
+    unsigned height;
+};
+
+// common sizes, and sizes hitting partial tiles and 16 byte tails
+static const frame_size default_sizes[] = {
+    {3840, 2160}, {1920, 1088}, {1920, 1080}, {1280, 720}, {720, 576}, {720, 480}, {640, 360},
+    {1366, 768}, {854, 480}, {426, 240}, {1918, 1078}, {350, 198}, {34, 18}, {2, 2},
+};
+
+struct tiled_frame {
+    unsigned width;
+    unsigned height;
+    unsigned pitch;
+    vector<unsigned char> y; // tiled
+    vector<unsigned char> uv; // tiled interleaved
+    tiled_frame(unsigned w, unsigned h) : width(w), height(h), pitch((w + 63) & ~63u) {
+        y.resize(((w + 31)/32)*((h + 31)/32)*1024);
+        uv.resize(((w + 31)/32)*((h/2 + 31)/32)*1024);
+        unsigned seed = w*65599 + h;
+        for (auto& c : y)
+            c = (unsigned char)((seed = seed*1103515245 + 12345) >> 16);
+        for (auto& c : uv)
+            c = (unsigned char)((seed = seed*1103515245 + 12345) >> 16);
+    }
+};
+
+// linear nv12/yuv420p outputs. padding bytes are filled to detect out of range writes in the compared region only
+struct linear_frame {
+    vector<unsigned char> p[3];
+    linear_frame(const tiled_frame& f) {
+        p[0].assign(f.pitch*f.height + 64, 0xcd);
+        p[1].assign(f.pitch*(f.height/2) + 64, 0xcd);
+        p[2].assign(f.pitch*(f.height/2) + 64, 0xcd);
+    }
+};
+
+static int compare(const char* what, const char* name, const tiled_frame& f, const unsigned char* a, const unsigned char* b, unsigned width, unsigned height)
+{
+    for (unsigned y = 0; y < height; ++y) {
+        const unsigned char* la = a + y*f.pitch;
+        const unsigned char* lb = b + y*f.pitch;
+        if (!memcmp(la, lb, width))
+            continue;
+        const unsigned x = unsigned(mismatch(la, la + width, lb).first - la);
+        printf("MISMATCH %s %s %ux%u: line %u, byte %u\n", name, what, f.width, f.height, y, x);
+        return 1;
+    }
+    return 0;
+}
+
+static void convert(const tiled_yuv_kernels* k, TiledWorkers* workers, const tiled_frame& f, linear_frame& d, bool planar)
+{
+    const tiled_plane planes[] = {
+        {f.y.data(), {d.p[0].data(), nullptr}, f.pitch, f.width, f.height, false, 0, 0, 0, nullptr, nullptr, 0, false},
+        {f.uv.data(), {d.p[1].data(), d.p[2].data()}, f.pitch, f.width, f.height/2, planar, 0, 0, 0, nullptr, nullptr, 0, true},
+    };
+    if (workers)
+        workers->convert(k, planes, 2);
+    else
+        tiled_convert(k, planes, 2);
+}
+
+// whole frame kernels and band conversion with every thread count
+static int check(const tiled_yuv_kernels* ref, const tiled_yuv_kernels* k, const vector<unique_ptr<TiledWorkers>>& workers, const tiled_frame& f)
+{
+    linear_frame r(f);
+    ref->map_y(f.y.data(), r.p[0].data(), f.pitch, f.width, f.height);
+    ref->map_c(f.uv.data(), r.p[1].data(), r.p[2].data(), f.pitch, f.width, f.height/2);
+    int bad = 0;
+    linear_frame d(f);
+    k->map_y(f.y.data(), d.p[0].data(), f.pitch, f.width, f.height);
+    k->map_c(f.uv.data(), d.p[1].data(), d.p[2].data(), f.pitch, f.width, f.height/2);
+    bad += compare("map_y", k->name, f, r.p[0].data(), d.p[0].data(), f.width, f.height);
+    bad += compare("map_c u", k->name, f, r.p[1].data(), d.p[1].data(), f.width/2, f.height/2);
+    bad += compare("map_c v", k->name, f, r.p[2].data(), d.p[2].data(), f.width/2, f.height/2);
+    for (const auto& w : workers) {
+        linear_frame t(f);
+        convert(k, w.get(), f, t, true);
+        bad += compare(w ? "pool y" : "convert y", k->name, f, r.p[0].data(), t.p[0].data(), f.width, f.height);
+        bad += compare(w ? "pool u" : "convert u", k->name, f, r.p[1].data(), t.p[1].data(), f.width/2, f.height/2);
+        bad += compare(w ? "pool v" : "convert v", k->name, f, r.p[2].data(), t.p[2].data(), f.width/2, f.height/2);
+        linear_frame nv12(f);
+        convert(k, w.get(), f, nv12, false);
+        // interleaved output is the tiled uv plane untiled, i.e. map_y of the uv plane
+        linear_frame uv(f);
+        ref->map_y(f.uv.data(), uv.p[0].data(), f.pitch, f.width, f.height/2);
+        bad += compare(w ? "pool uv" : "convert uv", k->name, f, uv.p[0].data(), nv12.p[1].data(), f.width, f.height/2);
+    }
+    return bad;
+}
+
+static unsigned char tiled_at(const vector<unsigned char>& t, unsigned width, unsigned x, unsigned y)
+{
+    const unsigned tiles = (width + 31)/32;
+    return t[size_t(y/32)*tiles*1024 + (x/32)*1024 + (y%32)*32 + x%32];
+}
+
+static unsigned char clamp_u8(int v)
+{
+    return v < 0 ? 0 : (v > 255 ? 255 : v);
+}
+
+// a rectangle of a plane, x, y, width and height are in bytes of the tiled plane, or luma pixels if rgb
+struct rect_case {
+    const char* what;
+    unsigned x;
+    unsigned y;
+    unsigned width;
+    unsigned height;
+    bool chroma;
+    bool deinterleave;
+    unsigned scale;
+    int rgb; // tiled_rgb_format, -1: yuv
+    bool bt709;
+    bool full_range;
+};
+
+static int check_rect(const tiled_yuv_kernels* k, TiledWorkers* workers, const tiled_frame& f, const rect_case& c)
+{
+    const unsigned s = c.scale > 1 ? c.scale : 1;
+    tiled_rgb_params params{};
+    if (c.rgb >= 0)
+        tiled_rgb_params_init(&params, tiled_rgb_format(c.rgb), c.bt709, c.full_range);
+    const unsigned bpp = c.rgb >= 0 ? tiled_rgb_bpp(params.format) : 1;
+    const unsigned out_w = c.rgb >= 0 ? c.width*bpp : (c.deinterleave ? c.width/2/s : c.width/s); // bytes of an output line
+    const unsigned out_h = c.height/s;
+    const unsigned pitch = out_w + 37;
+    const int nb = c.deinterleave ? 2 : 1;
+    vector<unsigned char> expect[2], out[2];
+    for (int i = 0; i < nb; ++i) {
+        expect[i].assign(size_t(out_w)*out_h, 0);
+        out[i].assign(size_t(pitch)*out_h + 64, 0xcd);
+    }
+    const vector<unsigned char>& src = c.chroma ? f.uv : f.y;
+    const unsigned shift = s == 2 ? 2 : (s == 4 ? 4 : 6);
+    for (unsigned y = 0; y < out_h; ++y) {
+        unsigned char* e0 = &expect[0][size_t(y)*out_w];
+        unsigned char* e1 = nb > 1 ? &expect[1][size_t(y)*out_w] : nullptr;
+        if (c.rgb >= 0) {
+            const int r = params.format == TILED_BGRA ? 2 : 0;
+            for (unsigned x = 0; x < c.width; ++x) {
+                const int du = tiled_at(f.uv, f.width, (c.x + x) & ~1u, (c.y + y)/2) - 128;
+                const int dv = tiled_at(f.uv, f.width, (c.x + x) | 1u, (c.y + y)/2) - 128;
+                const int yt = (tiled_at(f.y, f.width, c.x + x, c.y + y) - params.y_offset)*params.y_mul + 32;
+                unsigned char* d = e0 + x*bpp;
+                d[r] = clamp_u8((yt + params.rv*dv) >> 6);
+                d[1] = clamp_u8((yt - (params.gu*du + params.gv*dv)) >> 6);
+                d[2 - r] = clamp_u8((yt + params.bu*du) >> 6);
+                if (bpp == 4)
+                    d[3] = 255;
+            }
+        } else if (s == 1) {
+            for (unsigned x = 0; x < c.width; ++x) {
+                const unsigned char v = tiled_at(src, f.width, c.x + x, c.y + y);
+                if (!c.deinterleave)
+                    e0[x] = v;
+                else if (x % 2)
+                    e1[x/2] = v;
+                else
+                    e0[x/2] = v;
+            }
+        } else if (!c.chroma) {
+            for (unsigned x = 0; x < out_w; ++x) {
+                unsigned sum = 1 << (shift - 1);
+                for (unsigned r = 0; r < s; ++r) {
+                    for (unsigned j = 0; j < s; ++j)
+                        sum += tiled_at(src, f.width, c.x + x*s + j, c.y + y*s + r);
+                }
+                e0[x] = (unsigned char)(sum >> shift);
+            }
+        } else {
+            for (unsigned i = 0; i < c.width/(2*s); ++i) {
+                unsigned u = 1 << (shift - 1), v = u;
+                for (unsigned r = 0; r < s; ++r) {
+                    for (unsigned j = 0; j < s; ++j) {
+                        u += tiled_at(src, f.width, c.x + 2*(i*s + j), c.y + y*s + r);
+                        v += tiled_at(src, f.width, c.x + 2*(i*s + j) + 1, c.y + y*s + r);
+                    }
+                }
+                if (e1) {
+                    e0[i] = (unsigned char)(u >> shift);
+                    e1[i] = (unsigned char)(v >> shift);
+                } else {
+                    e0[2*i] = (unsigned char)(u >> shift);
+                    e0[2*i + 1] = (unsigned char)(v >> shift);
+                }
+            }
+        }
+    }
+    // destinations are not aligned
+    const tiled_plane p{src.data(), {out[0].data() + 1, nb > 1 ? out[1].data() + 1 : nullptr}, pitch, c.width, c.height, c.deinterleave, c.x, c.y, f.width,
+                        c.rgb >= 0 ? f.uv.data() : nullptr, c.rgb >= 0 ? &params : nullptr, c.scale, c.chroma};
+    if (workers)
+        workers->convert(k, &p, 1);
+    else
+        tiled_convert(k, &p, 1);
+    for (int i = 0; i < nb; ++i) {
+        const unsigned char* o = out[i].data() + 1;
+        for (unsigned y = 0; y < out_h; ++y) {
+            const unsigned char* lo = o + size_t(y)*pitch;
+            const unsigned char* le = &expect[i][size_t(y)*out_w];
+            const unsigned char* guard = find_if(lo + out_w, lo + pitch, [](unsigned char b){ return b != 0xcd; });
+            if (memcmp(lo, le, out_w) == 0 && guard == lo + pitch && out[i][0] == 0xcd)
+                continue;
+            const unsigned x = memcmp(lo, le, out_w) ? unsigned(mismatch(lo, lo + out_w, le).first - lo) : unsigned(guard - lo);
+            printf("MISMATCH %s %s plane %d %ux%u rect %u,%u %ux%u%s: line %u, byte %u\n", k->name, c.what, i, f.width, f.height, c.x, c.y, c.width, c.height,
+                   workers ? " pool" : "", y, x);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// rgb, downscaled and sub-rectangle paths, whole lines and tile aligned heads/tails are covered by other cases
+static int check_paths(const tiled_yuv_kernels* k, const vector<unique_ptr<TiledWorkers>>& workers, const tiled_frame& f)
+{
+    vector<rect_case> cases;
+    const unsigned w = f.width, h = f.height;
+    // luma copy at odd offsets and widths, inside a tile and across many tiles
+    if (w > 8 && h > 4) {
+        cases.push_back({"rect y", 3, 1, w - 8, h - 4, false, false, 1, -1, false, false});
+        cases.push_back({"rect y narrow", 5, 0, std::min(w - 5, 21u), h, false, false, 1, -1, false, false});
+    }
+    if (w > 80 && h > 40)
+        cases.push_back({"rect y mid", 37, 6, 43, 33, false, false, 1, -1, false, false});
+    // uv plane: x and width are even bytes
+    if (w > 16 && h > 8) {
+        cases.push_back({"rect uv", 6, 1, (w - 14) & ~1u, h/2 - 2, true, false, 1, -1, false, false});
+        cases.push_back({"rect u v", 6, 1, (w - 14) & ~1u, h/2 - 2, true, true, 1, -1, false, false});
+        cases.push_back({"rect u v narrow", 34, 0, std::min((w - 34) & ~1u, 10u), h/2, true, true, 1, -1, false, false});
+    }
+    // rgb: luma pixels, even
+    for (int fmt = TILED_RGBA; fmt <= TILED_RGB24; ++fmt) {
+        for (int m = 0; m < 4; ++m)
+            cases.push_back({"rgb", 0, 0, w, h, false, false, 1, fmt, !!(m & 1), !!(m & 2)});
+        if (w > 16 && h > 8)
+            cases.push_back({"rgb rect", 6, 2, (w - 14) & ~1u, (h - 6) & ~1u, false, false, 1, fmt, true, false});
+    }
+    // downscale: luma region is a multiple of scale, chroma a multiple of 2x scale bytes
+    for (unsigned s = 2; s <= 8; s *= 2) {
+        const unsigned x = w > 4*s + 10 ? 10 : 0;
+        const unsigned y = h > 4*s + 2 ? 2 : 0;
+        const unsigned sw = (w - x)/(2*s)*(2*s), sh = (h - y)/(2*s)*(2*s);
+        if (!sw || !sh)
+            continue;
+        cases.push_back({"scaled y", x, y, sw, sh, false, false, s, -1, false, false});
+        cases.push_back({"scaled y full", 0, 0, w/s*s, h/s*s, false, false, s, -1, false, false});
+        if (sh/2 >= s && sh/2 % s == 0) {
+            cases.push_back({"scaled uv", x, y/2, sw, sh/2, true, false, s, -1, false, false});
+            cases.push_back({"scaled u v", x, y/2, sw, sh/2, true, true, s, -1, false, false});
+        }
+    }
+    int bad = 0;
+    for (const auto& c : cases) {
+        if (!c.width || !c.height)
+            continue;
+        bad += check_rect(k, nullptr, f, c);
+        for (const auto& t : workers) {
+            if (t)
+                bad += check_rect(k, t.get(), f, c);
+        }
+    }
+    return bad;
+}
+
+static double now_ns()
+{
+    return (double)chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void bench(const tiled_yuv_kernels* k, TiledWorkers* workers, int threads, const tiled_frame& f, int frames)
+{
+    linear_frame d(f);
+    double t0 = now_ns();
+    if (!workers && threads == 0) { // whole frame kernels
+        for (int i = 0; i < frames; ++i) {
+            k->map_y(f.y.data(), d.p[0].data(), f.pitch, f.width, f.height);
+            k->map_c(f.uv.data(), d.p[1].data(), d.p[2].data(), f.pitch, f.width, f.height/2);
+        }
+    } else {
+        for (int i = 0; i < frames; ++i)
+            convert(k, workers, f, d, true);
+    }
+    const double ns = (now_ns() - t0)/frames;
+    const double bytes = double(f.width)*f.height*3/2; // output bytes
+    char mode[16];
+    if (threads == 0)
+        snprintf(mode, sizeof(mode), "frame");
+    else if (!workers)
+        snprintf(mode, sizeof(mode), "convert");
+    else
+        snprintf(mode, sizeof(mode), "pool x%d", threads);
+    printf("%-8s %-10s %5ux%-5u %12.0f ns/frame %10.1f MB/s\n", k->name, mode, f.width, f.height, ns, bytes*1000.0/ns);
+}
+
+static vector<int> parse_ints(const char* s)
+{
+    vector<int> v;
+    while (s && *s) {
+        v.push_back(atoi(s));
+        s = strchr(s, ',');
+        if (s)
+            ++s;
+    }
+    return v;
+}
+
+int main(int argc, char* argv[])
+{
+    int frames = 0; // 0: about 1 second per size
+    vector<int> threads;
+    vector<frame_size> sizes;
+    const char* name = nullptr;
+    for (int i = 1; i < argc; ++i) {
+        const char* a = argv[i];
+        const char* v = i + 1 < argc ? argv[i+1] : nullptr;
+        if (!strcmp(a, "-n") && v) {
+            frames = atoi(v);
+        } else if (!strcmp(a, "-t") && v) {
+            threads = parse_ints(v);
+        } else if (!strcmp(a, "-k") && v) {
+            name = v;
+        } else if (!strcmp(a, "-s") && v) {
+            for (const char* s = v; s && *s; s = strchr(s, ',') ? strchr(s, ',') + 1 : nullptr) {
+                frame_size fs{};
+                if (sscanf(s, "%ux%u", &fs.width, &fs.height) == 2 && fs.width && fs.height)
+                    sizes.push_back({fs.width & ~1u, fs.height & ~1u});
+            }
+        } else {
+            printf("usage: %s [-n frames] [-t threads,...] [-s WxH,...] [-k kernel]\n", argv[0]);
+            return 0;
+        }
+        ++i;
+    }
+    if (sizes.empty())
+        sizes.assign(begin(default_sizes), end(default_sizes));
+    if (threads.empty()) {
+        threads = {1};
+        for (int n = 2, nc = (int)thread::hardware_concurrency(); n <= max(nc, 2); n *= 2)
+            threads.push_back(n);
+    }
+    vector<unique_ptr<TiledWorkers>> workers;
+    for (auto n : threads)
+        workers.emplace_back(n > 1 ? new TiledWorkers(n) : nullptr);
+
+    int nb = 0;
+    const tiled_yuv_kernels* k = tiled_yuv_kernels_supported(&nb);
+    const tiled_yuv_kernels* ref = &k[0];
+    printf("kernels:");
+    for (int i = 0; i < nb; ++i)
+        printf(" %s", k[i].name);
+    printf(", selected: %s\n", tiled_yuv_kernels_select()->name);
+
+    int bad = 0;
+    for (const auto& s : sizes) {
+        const tiled_frame f(s.width, s.height);
+        for (int i = 0; i < nb; ++i) {
+            if (name && strcmp(name, k[i].name))
+                continue;
+            bad += check(ref, &k[i], workers, f);
+            bad += check_paths(&k[i], workers, f);
+            const int n = frames > 0 ? frames : max(1, int(2e8/(double(f.width)*f.height*3/2 + 1)));
+            bench(&k[i], nullptr, 0, f, n);
+            for (size_t t = 0; t < threads.size(); ++t)
+                bench(&k[i], workers[t].get(), threads[t], f, n);
+        }
+    }
+    printf("%s: %d mismatches\n", bad ? "FAILED" : "PASSED", bad);
+    return bad;
+}
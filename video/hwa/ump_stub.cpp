@@ -0,0 +1,98 @@
+/*
+ * Copyright (c) 2018-2020 WangBin <wbsecg1 at gmail.com>
+ */
+// UMP in host memory for hosts without UMP driver, link it instead of libUMP.
+// memory is not physically contiguous, so it can be mapped by cpu only. secure ids are valid in process
+#include <ump/ump.h>
+#include <ump/ump_ref_drv.h>
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <unordered_map>
+
+namespace {
+struct ump_mem {
+    std::atomic<int> refs{1};
+    ump_secure_id id = UMP_INVALID_SECURE_ID;
+    unsigned long size = 0;
+    void* data = nullptr;
+};
+
+std::mutex ids_mutex;
+std::unordered_map<ump_secure_id, ump_mem*> ids;
+ump_secure_id next_id = 1;
+
+ump_mem* mem(ump_handle h) { return static_cast<ump_mem*>(h); }
+} // namespace
+
+extern "C" {
+ump_result ump_open(void) { return UMP_OK; }
+void ump_close(void) {}
+
+ump_handle ump_ref_drv_allocate(unsigned long size, ump_alloc_constraints)
+{
+    if (!size)
+        return UMP_INVALID_MEMORY_HANDLE;
+    auto m = new ump_mem();
+    m->size = size;
+    if (posix_memalign(&m->data, 64, size) != 0) {
+        delete m;
+        return UMP_INVALID_MEMORY_HANDLE;
+    }
+    std::lock_guard<std::mutex> lock(ids_mutex);
+    m->id = next_id++;
+    ids[m->id] = m;
+    return m;
+}
+
+ump_secure_id ump_secure_id_get(ump_handle h) { return h ? mem(h)->id : UMP_INVALID_SECURE_ID; }
+
+ump_handle ump_handle_create_from_secure_id(ump_secure_id id)
+{
+    std::lock_guard<std::mutex> lock(ids_mutex);
+    const auto it = ids.find(id);
+    if (it == ids.end())
+        return UMP_INVALID_MEMORY_HANDLE;
+    it->second->refs++;
+    return it->second;
+}
+
+void ump_reference_add(ump_handle h)
+{
+    if (h)
+        mem(h)->refs++;
+}
+
+void ump_reference_release(ump_handle h)
+{
+    if (!h)
+        return;
+    auto m = mem(h);
+    {
+        std::lock_guard<std::mutex> lock(ids_mutex); // no new handle from secure id while releasing the last one
+        if (--m->refs > 0)
+            return;
+        ids.erase(m->id);
+    }
+    free(m->data);
+    delete m;
+}
+
+unsigned long ump_size_get(ump_handle h) { return h ? mem(h)->size : 0; }
+void* ump_mapped_pointer_get(ump_handle h) { return h ? mem(h)->data : nullptr; }
+void ump_mapped_pointer_release(ump_handle) {}
+
+void ump_read(void* dst, ump_handle src, unsigned long offset, unsigned long length)
+{
+    memcpy(dst, (const char*)mem(src)->data + offset, length);
+}
+
+int ump_write(ump_handle dst, unsigned long offset, const void* src, unsigned long length)
+{
+    if (!dst || offset + length > mem(dst)->size)
+        return -1;
+    memcpy((char*)mem(dst)->data + offset, src, length);
+    return 0;
+}
+} // extern "C"